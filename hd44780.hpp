@@ -0,0 +1,187 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * Header-only C++ front end for HD44780 displays on a 4 bit bus. Pinout,
+ * geometry and timing are template parameters, so masks, nibble shifts, row
+ * starts and waits are all resolved at compile time, and several LCDs with
+ * different pinouts live in the same program as different instantiations.
+ * When RS is on the data port, RS and each nibble go out in one port store.
+ *
+ * It is the blocking core of lcd4bits: the same init sequence, execution
+ * times and LCD_EXEC_SCALE-like scaling, without the DDRAM mirror, the
+ * queue or the text units. hd44780_test.cpp runs it against lcd_sim.
+ *
+ * A port is a class with get(), set() and output(); a Bus policy names the
+ * ports and the bits the LCD is wired to:
+ *
+ *     struct PortC {
+ *         static uint8_t get()                 { return PORTC; }
+ *         static void set(uint8_t value)       { PORTC = value; }
+ *         static void output(uint8_t mask)     { DDRC |= mask; }
+ *     };
+ *
+ *     struct MyBus {
+ *         typedef PortC DataPort;              // DB4..DB7 on data_lsb..data_lsb+3
+ *         typedef PortC EPort;
+ *         typedef PortC RsPort;
+ *         static const uint8_t data_lsb = 0;
+ *         static const uint8_t e_bit    = 4;
+ *         static const uint8_t rs_bit   = 6;
+ *         static void delay_us(unsigned long us) { while (us--) _delay_us(1); }
+ *     };
+ *
+ *     typedef hd44780::Hd44780<MyBus, hd44780::Geometry20x4> Lcd;
+ *     Lcd::init(false, false);
+ *     Lcd::goto_rc(3, 0);
+ *     Lcd::write("Hello");
+ */
+
+#ifndef HD44780_HPP_
+#define HD44780_HPP_
+
+#include <stdint.h>
+
+namespace hd44780 {
+
+/// GEOMETRIES
+
+// Rows 3 and 4 continue rows 1 and 2 in DDRAM, as with LCD_ROWS 4
+template <uint8_t Cols, uint8_t Rows>
+struct Geometry {
+    static const uint8_t cols = Cols;
+    static const uint8_t rows = Rows;
+    static const bool two_lines = Rows > 1;
+    static uint8_t row_start(uint8_t row) { return uint8_t((row & 1 ? 0x40 : 0x00) + (row & 2 ? Cols : 0)); }
+};
+
+typedef Geometry<16, 2> Geometry16x2;
+typedef Geometry<20, 4> Geometry20x4;
+typedef Geometry<40, 2> Geometry40x2;
+typedef Geometry<16, 1> Geometry16x1;
+
+
+/// TIMINGS
+
+// Datasheet values for fosc = 270 kHz, in us, times Scale/100 as LCD_EXEC_SCALE does
+template <unsigned int Scale = 100>
+struct Timing {
+    static const unsigned long power_on_us  = 20000;
+    static const unsigned long init1_us     = 5000;
+    static const unsigned long init2_us     = 500;
+    static const unsigned long clear_us     = 1520UL*Scale/100;
+    static const unsigned long home_us      = 1520UL*Scale/100;
+    static const unsigned long exec_us      = 37UL*Scale/100;
+    static const unsigned long write_us     = 41UL*Scale/100;
+    static const unsigned long enable_us    = 1;
+};
+
+typedef Timing<100> TimingHd44780;
+typedef Timing<200> TimingSlowClone;        // Oscillator at about half the nominal frequency
+
+
+/// DRIVER
+
+template <class A, class B> struct same_port        { static const bool value = false; };
+template <class A>          struct same_port<A, A>  { static const bool value = true; };
+
+template <class Bus, class Geometry = Geometry16x2, class Timing = TimingHd44780>
+class Hd44780 {
+
+public:
+
+    static const uint8_t data_mask  = uint8_t(0x0F << Bus::data_lsb);
+    static const uint8_t e_mask     = uint8_t(1 << Bus::e_bit);
+    static const uint8_t rs_mask    = uint8_t(1 << Bus::rs_bit);
+    static const bool rs_on_data_port = same_port<typename Bus::RsPort, typename Bus::DataPort>::value;
+
+    static void init(bool cursor_on, bool blink_on){
+
+        Bus::DataPort::output(data_mask);
+        Bus::EPort::output(e_mask);
+        Bus::RsPort::output(rs_mask);
+        Bus::EPort::set(uint8_t(Bus::EPort::get() & ~e_mask));
+
+        Bus::delay_us(Timing::power_on_us);
+        nibble(0x03, false);
+        Bus::delay_us(Timing::init1_us);
+        nibble(0x03, false);
+        Bus::delay_us(Timing::init2_us);
+        nibble(0x03, false);
+        Bus::delay_us(Timing::exec_us);
+        nibble(0x02, false);
+        Bus::delay_us(Timing::exec_us);
+
+        command(Geometry::two_lines ? 0x28 : 0x20);
+        command(uint8_t(0x0C | (cursor_on ? 0x02 : 0) | (blink_on ? 0x01 : 0)));
+        command(0x06);
+        clear();
+
+    }
+
+    static void command(uint8_t inst){
+        nibble(inst >> 4, false);
+        nibble(inst, false);
+        if (inst & 0xFC) Bus::delay_us(Timing::exec_us);
+        else if (inst & 0x02) Bus::delay_us(Timing::home_us);
+        else Bus::delay_us(Timing::clear_us);
+    }
+
+    static void write(char ch){
+        nibble(uint8_t(ch) >> 4, true);
+        nibble(uint8_t(ch), true);
+        Bus::delay_us(Timing::write_us);
+    }
+
+    static void write(const char *str){
+        while (*str) write(*str++);
+    }
+
+    static void clear()                             { command(0x01); }
+    static void home()                              { command(0x02); }
+    static void set_address(uint8_t address)        { command(uint8_t(0x80 | address)); }
+    static void goto_rc(uint8_t row, uint8_t col)   { set_address(uint8_t(Geometry::row_start(row) + col)); }
+
+private:
+
+    static void nibble(uint8_t value, bool rs){
+
+        if (rs_on_data_port){
+            // RS and data in a single store
+            Bus::DataPort::set(uint8_t( (Bus::DataPort::get() & ~(data_mask | rs_mask)) |
+                                        ((value << Bus::data_lsb) & data_mask) | (rs ? rs_mask : 0) ));
+        }else{
+            Bus::RsPort::set(uint8_t( rs ? Bus::RsPort::get() | rs_mask : Bus::RsPort::get() & ~rs_mask ));
+            Bus::DataPort::set(uint8_t( (Bus::DataPort::get() & ~data_mask) | ((value << Bus::data_lsb) & data_mask) ));
+        }
+
+        Bus::EPort::set(uint8_t(Bus::EPort::get() | e_mask));
+        Bus::delay_us(Timing::enable_us);
+        Bus::EPort::set(uint8_t(Bus::EPort::get() & ~e_mask));
+        Bus::delay_us(Timing::enable_us);
+
+    }
+
+};
+
+} // namespace hd44780
+
+#endif /* HD44780_HPP_ */
@@ -0,0 +1,184 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * Host test of hd44780.hpp. Two instantiations with different pinouts and
+ * geometries drive two simulated controllers sharing one port, the second
+ * one with RS on a port of its own. Checks what each LCD shows, that no
+ * byte reaches a busy LCD, at nominal and at half oscillator frequency, and
+ * how many port stores a char takes with and without RS on the data port.
+ * Exits with status 3 on a failure.
+ *
+ *     gcc -c -DLCD_BUS_CUSTOM lcd_sim.c
+ *     g++ -DLCD_BUS_CUSTOM -o hd44780_test hd44780_test.cpp lcd_sim.o
+ *     ./hd44780_test
+ */
+
+#include <stdio.h>
+#include "hd44780.hpp"
+extern "C" {
+#include "lcd_sim.h"
+}
+
+/// PORTS
+
+// Two ports wired to the simulator. Port 0: DB4..DB7 on bits 0..3, the E lines of
+// controllers 4 and 5 on bits 4 and 5, RS of controller 4 on bit 6. Port 1: RS of
+// controller 5 on bit 1. The simulator has one RS line, so each controller gets
+// its own as its E line moves
+uint8_t pins[2];
+unsigned long stores;
+
+void wire(uint8_t port, uint8_t value){
+
+    uint8_t changed, e_bit;
+
+    stores++;
+    changed = pins[port] ^ value;
+    pins[port] = value;
+    if (port) return;
+
+    lcd_sim_bus.set_data(value & 0x0F);
+    for (e_bit = 4; e_bit <= 5; e_bit++){
+        if (!(changed & (1 << e_bit))) continue;
+        lcd_sim_bus.set_rs(e_bit == 4 ? (pins[0] >> 6) & 1 : (pins[1] >> 1) & 1);
+        lcd_sim_bus.set_en(1 << e_bit, (value >> e_bit) & 1);
+    }
+
+}
+
+template <uint8_t Id>
+struct SimPort {
+    static uint8_t get()                { return pins[Id]; }
+    static void set(uint8_t value)      { wire(Id, value); }
+    static void output(uint8_t)         { }
+};
+
+typedef SimPort<0> Port1;
+typedef SimPort<1> Port2;
+
+// A 16x2 with everything on Port1, E on bit 4
+struct BusA {
+    typedef Port1 DataPort;
+    typedef Port1 EPort;
+    typedef Port1 RsPort;
+    static const uint8_t data_lsb = 0;
+    static const uint8_t e_bit    = 4;
+    static const uint8_t rs_bit   = 6;
+    static void delay_us(unsigned long us) { lcd_sim_bus.delay_us(us); }
+};
+
+// A 20x4 slow clone sharing data lines with it, E on bit 5 and RS on Port2
+struct BusB {
+    typedef Port1 DataPort;
+    typedef Port1 EPort;
+    typedef Port2 RsPort;
+    static const uint8_t data_lsb = 0;
+    static const uint8_t e_bit    = 5;
+    static const uint8_t rs_bit   = 1;
+    static void delay_us(unsigned long us) { lcd_sim_bus.delay_us(us); }
+};
+
+typedef hd44780::Hd44780<BusA, hd44780::Geometry16x2> LcdA;
+typedef hd44780::Hd44780<BusB, hd44780::Geometry20x4, hd44780::TimingSlowClone> LcdB;
+
+static_assert(LcdA::rs_on_data_port && !LcdB::rs_on_data_port, "RS port detection");
+static_assert(LcdA::data_mask == 0x0F && LcdA::e_mask == 0x10 && LcdB::e_mask == 0x20 && LcdB::rs_mask == 0x02,
+              "masks are not compile-time constants");
+
+
+/// CHECKS
+
+int failures;
+
+// Compares DDRAM of the controller on "e_bit" from "address" on with text[]
+void expect_ddram(const char *name, uint8_t e_bit, uint8_t address, const char *text){
+
+    uint8_t i;
+
+    lcd_sim_select(e_bit);
+    for (i = 0; text[i]; i++){
+        if (lcd_sim_ddram(address + i) == (uint8_t)text[i]) continue;
+        fprintf(stderr, "WRONG %s: DDRAM 0x%02X holds 0x%02X, expected 0x%02X\n", name,
+                address + i, lcd_sim_ddram(address + i), (uint8_t)text[i]);
+        failures++;
+        return;
+    }
+
+}
+
+void expect_no_violations(const char *name){
+
+    lcd_sim_counters c = lcd_sim_get_counters();
+
+    if (!c.busy_violations) return;
+    fprintf(stderr, "BUSY %s: %lu busy violations\n", name, c.busy_violations);
+    failures++;
+
+}
+
+// Port stores one write(char) takes
+void expect_stores(const char *name, unsigned long stores, unsigned long expected){
+
+    if (stores == expected) return;
+    fprintf(stderr, "WRONG %s: %lu port stores per char, expected %lu\n", name, stores, expected);
+    failures++;
+
+}
+
+int main(void){
+
+    unsigned long before;
+
+    // Both LCDs at nominal speed
+    lcd_sim_reset(LCD_SIM_FOSC_KHZ);
+    LcdA::init(false, false);
+    LcdB::init(false, false);
+    LcdA::write("Hello");
+    LcdA::goto_rc(1, 0);
+    LcdA::write("World");
+    LcdB::goto_rc(3, 0);
+    LcdB::write("Row 4");
+    expect_no_violations("nominal");
+    expect_ddram("16x2", BusA::e_bit, 0x00, "Hello");
+    expect_ddram("16x2", BusA::e_bit, 0x40, "World");
+    expect_ddram("20x4", BusB::e_bit, 0x54, "Row 4");
+    expect_ddram("20x4", BusB::e_bit, 0x00, "    ");
+
+    // Data and RS in one store, then E up and down, per nibble
+    before = stores;
+    LcdA::write('!');
+    expect_stores("rs_on_data_port", stores - before, 2*3);
+    before = stores;
+    LcdB::write('!');
+    expect_stores("rs_on_own_port", stores - before, 2*4);
+
+    // The slow clone's timing covers an oscillator at half the nominal frequency
+    lcd_sim_reset(LCD_SIM_FOSC_KHZ/2);
+    LcdB::init(false, false);
+    LcdB::goto_rc(2, 0);
+    LcdB::write("Slow");
+    expect_no_violations("half_fosc");
+    expect_ddram("20x4_slow", BusB::e_bit, 0x14, "Slow");
+
+    return failures ? 3 : 0;
+
+}
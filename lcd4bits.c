@@ -21,19 +21,180 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 
 #include "lcd4bits.h"
 
-byte        last_unit_available;
-text_units  units;
-unit_tags   tags;
+lcd_display lcd_main = { .marquee_tag = NO_MARQUEE, .e_mask = LCD_E_MASK };
+lcd_display *lcd = &lcd_main;               // Display every function acts on
+const byte  *glyph_table;                   // Bitmaps of every glyph, 8 bytes each, in flash
+byte        glyph_amount;
+const lcd_char_map *glyph_map;              // Glyphs standing in for chars missing from the ROM, in flash
+byte        glyph_map_amount;
+
+#ifdef LCD_UTF8
+unsigned long utf8_code;                    // Code point being decoded
+byte        utf8_left;                      // Continuation bytes it still needs
+
+// Chars outside ASCII, sorted by code point. Contiguous runs are in ROM_RUN_*
+#ifndef LCD_ROM_A02
+const lcd_char_map rom_chars[] PROGMEM = {
+    {0x00A2, 0xEC}, {0x00A5, 0x5C}, {0x00B0, 0xDF}, {0x00B5, 0xE4}, {0x00B7, 0xA5},
+    {0x00DF, 0xE2}, {0x00E4, 0xE1}, {0x00F1, 0xEE}, {0x00F6, 0xEF}, {0x00F7, 0xFD},
+    {0x00FC, 0xF5}, {0x03A3, 0xF6}, {0x03A9, 0xF4}, {0x03B1, 0xE0}, {0x03B2, 0xE2},
+    {0x03B5, 0xE3}, {0x03B8, 0xF2}, {0x03BC, 0xE4}, {0x03C0, 0xF7}, {0x03C1, 0xE6},
+    {0x03C3, 0xE5}, {0x2126, 0xF4}, {0x2190, 0x7F}, {0x2192, 0x7E}, {0x221A, 0xE8},
+    {0x221E, 0xF3}, {0x2588, 0xFF}, {0x3001, 0xA4}, {0x3002, 0xA1}, {0x300C, 0xA2},
+    {0x300D, 0xA3}
+};
+#define ROM_RUN_FIRST            0xFF61   // Halfwidth katakana
+#define ROM_RUN_LAST             0xFF9F
+#define ROM_RUN_CODE             0xA1
+#define ROM_ASCII_MISSING(ch)    ( (ch) == '\\' || (ch) == '~' )    // Replaced by the yen sign and an arrow
+#else
+const lcd_char_map rom_chars[] PROGMEM = {
+    {0x00A1, 0xA1}, {0x00A2, 0xA2}, {0x00A3, 0xA3}, {0x00A4, 0xA4}, {0x00A5, 0xA5},
+    {0x00A7, 0xA7}, {0x00A9, 0xA9}, {0x00AA, 0xAA}, {0x00AB, 0xAB}, {0x00AE, 0xAE},
+    {0x00B0, 0xB0}, {0x00B1, 0xB1}, {0x00B2, 0xB2}, {0x00B3, 0xB3}, {0x00B5, 0xB5},
+    {0x00B6, 0xB6}, {0x00B7, 0xB7}, {0x00B9, 0xB9}, {0x00BA, 0xBA}, {0x00BB, 0xBB},
+    {0x00BC, 0xBC}, {0x00BD, 0xBD}, {0x00BE, 0xBE}, {0x00BF, 0xBF}, {0x0393, 0x92},
+    {0x0398, 0x99}, {0x03A3, 0x94}, {0x03A9, 0x9A}, {0x03B1, 0x90}, {0x03B4, 0x9B},
+    {0x03B5, 0x9E}, {0x03BC, 0xB5}, {0x03C0, 0x93}, {0x03C3, 0x95}, {0x03C4, 0x97},
+    {0x2126, 0x9A}, {0x2190, 0x1B}, {0x2191, 0x18}, {0x2192, 0x1A}, {0x2193, 0x19},
+    {0x221E, 0x9C}, {0x2229, 0x9F}, {0x2264, 0x1C}, {0x2265, 0x1D}, {0x25B2, 0x1E},
+    {0x25B6, 0x10}, {0x25BC, 0x1F}, {0x25C0, 0x11}, {0x2665, 0x9D}
+};
+#define ROM_RUN_FIRST            0x00C0   // Latin-1 letters
+#define ROM_RUN_LAST             0x00FF
+#define ROM_RUN_CODE             0xC0
+#define ROM_ASCII_MISSING(ch)    FALSE
+#endif
+#define ROM_CHARS_AMT            (sizeof(rom_chars)/sizeof(rom_chars[0]))
+#endif
+
+#ifndef LCD_USE_RW
+unsigned int lcd_clock_us;                  // Time spent in delays, the only time the driver can tell
+#endif
+
+const byte  row_start[4] = {L1_START, L2_START, L3_START, L4_START};
+
+byte        put_address;                    // Where put_char() writes next
+byte        put_jump;                       // Text being put jumps rows, as in write_text()
+byte        put_count;                      // Chars put so far, when jumping
+byte        put_row;
+byte        put_col;
+
+#ifdef LCD_BUS_CUSTOM
+const lcd_bus   *lcd_bus_backend;
+#endif
+
+#ifdef LCD_STATS
+lcd_stats       lcd_stats_counters;
+#endif
+
+#ifdef LCD_POST
+lcd_post_slot   post_slots[LCD_POST_QUEUE_SIZE];
+#ifdef LCD_BUS_CUSTOM
+atomic_uchar    post_head;                  // Next position to reserve, shared by producers
+#else
+volatile byte   post_head;
+#endif
+byte            post_tail;                  // Next position to run, lcd_process() only
+#endif
+
+#ifdef LCD_ASYNC
+volatile byte   queue_head;                 // Next free slot, written by producers only
+volatile byte   queue_tail;                 // Byte being sent, written by lcd_service() only
+byte            queue_data[LCD_QUEUE_SIZE];
+byte            queue_rs[LCD_QUEUE_SIZE/8]; // RS line value for every queued byte
+byte            queue_e[LCD_QUEUE_SIZE];    // E line of the display every queued byte goes to
+volatile byte   service_wait;               // Ticks left until the LCD is done executing
+byte            service_half;               // 2nd half of queue_data[queue_tail] has been sent
+#endif
+
+#ifndef LCD_USE_RW
+// Wait after each instruction class, indexed by the instruction's highest bit set (see
+// instruction_class()): ticks of lcd_service() with LCD_ASYNC, us otherwise
+#ifdef LCD_ASYNC
+const byte exec_classes[8] = {
+#else
+const unsigned int exec_classes[8] = {
+#endif
+    _exec_class(LCD_EXEC_CLEAR_US),     _exec_class(LCD_EXEC_HOME_US),
+    _exec_class(LCD_EXEC_ENTRY_US),     _exec_class(LCD_EXEC_CONTROL_US),
+    _exec_class(LCD_EXEC_SHIFT_US),     _exec_class(LCD_EXEC_FUNCTION_US),
+    _exec_class(LCD_EXEC_CGRAM_US),     _exec_class(LCD_EXEC_DDRAM_US)
+};
+#endif
 
 void enable(void);
+void bus_write(byte value, byte rs);
 void exec_instruction(byte inst);
+void send_char(char ch);
+void wait_busy(void);
+byte read_busy(byte e_mask);
+byte read_data(void);
+void wait_ready(void);
+unsigned int busy_left(void);
+byte shadow_pending(void);
+void exec_wait(byte inst);
+byte instruction_class(byte inst);
+void queue_push(byte rs, byte value);
+void shadow_put(byte address, char ch);
+byte shadow_flush(unsigned int budget_us);
+void shadow_commit(void);
+void set_address(byte address);
+void sync_cursor(void);
+void shift_display_to(byte shift);
+void shift_restore(void);
+byte marquee_fits(byte tag);
+void marquee_start(byte tag);
+void marquee_stop(void);
+byte address_row(byte address);
+byte unit_slot(byte tag);
+byte unit_new(byte len, byte chars, byte window_size, byte jump);
+void unit_put(byte slot, byte start_address, byte on);
+void put_begin(byte start_address, byte jump);
+void put_char(char ch);
+void put_end(void);
+void cgram_touch(byte slot);
+void cgram_upload(void);
+byte glyph_row(byte id, byte row);
+byte bar_cell_address(lcd_bar *bar, byte cell);
+char bar_cell_char(lcd_bar *bar, byte cell, byte value);
+byte number_digits(lcd_number *field, long value, char digits[]);
+void compact_text_units(void);
+#ifdef LCD_UTF8
+byte put_utf8(char ch);
+byte utf8_decode(char ch);
+char rom_char(unsigned long code_point);
+byte utf8_chars(const char *str, byte len, byte flash);
+byte unit_char_pos(byte slot, byte index);
+byte unit_next(byte slot, byte pos);
+char unit_rom_char(byte slot, byte pos);
+#endif
+#ifdef LCD_POST
+lcd_post_slot *post_reserve(byte op, byte *position);
+void post_publish(byte position);
+#endif
+#if defined(LCD_STATS) && defined(LCD_ASYNC_ISR) && !defined(LCD_BUS_CUSTOM)
+void stat_add(unsigned long *counter, unsigned long n);
+#endif
 
 
 void initialize_lcd(byte cursor_on, byte blink_on){
 
+#ifndef LCD_BUS_CUSTOM
     LCD_DATA_PORT_CONFIG    |= LCD_DATA_MASK;
-    LCD_E_PORT_CONFIG       |= LCD_E_MASK;
+    LCD_E_PORT_CONFIG       |= lcd->e_mask;
     LCD_RS_PORT_CONFIG      |= LCD_RS_MASK;
+#ifdef LCD_USE_RW
+    LCD_RW_PORT_CONFIG      |= LCD_RW_MASK;
+#endif
+#else
+    _data_as_output();
+#endif
+#ifdef LCD_USE_RW
+    _set_RW_to_0();
+#endif
+    _set_EN_to_0(lcd->e_mask);
+    _set_RS_to_0();
 
     reset_lcd(cursor_on, blink_on);
 
@@ -43,308 +204,1845 @@ void reset_lcd(byte cursor_on, byte blink_on){
 
     byte aux;
 
+#ifdef LCD_ASYNC
+    // The init sequence drives the bus directly
+    lcd_flush();
+#endif
+
+    _set_RS_to_0();
+
     // Wait longer than 15ms
     _ini_wait1();
 
     // FIRST GO
-    _set_data(0b00000011);
+    _set_data_high(FUNCTION_SET_8BIT);
     enable();
 
     // Wait at least 4.1 ms
     _ini_wait2();
 
     // SECOND GO
-    _set_data(0b00000011);
+    _set_data_high(FUNCTION_SET_8BIT);
     enable();
 
     // Wait 100 us
     _ini_wait3();
 
     // THIRD GO
-    _set_data(0b00000011);
+    _set_data_high(FUNCTION_SET_8BIT);
     enable();
 
-    // FUNCTION SET
-    _set_data(0b00000010);
-    enable();
+    // Busy flag can't be checked until after the next function set
+    _warm_wait();
 
-    // FUNCION SET 2
-    _set_data(0b00000010);
-    enable();
-    _set_data(0b00001000);
+#ifndef LCD_8BIT
+    // FUNCTION SET, switches to 4 bit interface
+    _set_data_high(FUNCTION_SET_4BIT);
     enable();
+    _warm_wait();
+#endif
 
-    // Display ON/OFF control
-    _set_data(0b00000000);
-    enable();
+    // FUNCION SET 2, from here on instructions are waited for by their class, or
+    // queued with LCD_ASYNC
+    exec_instruction(FUNCTION_SET);
 
-    aux = 0b00001100;
+    // Display ON/OFF control
+    aux = CMD_DISP_ON;
     if (cursor_on) aux |= CURSOR_BIT;
     if (blink_on) aux |= CURSORBLINK_BIT;
-    _set_data(aux);
-    enable();
+    exec_instruction(aux);
+
+    lcd->display_control = aux;
 
     // Entry mode set
-    _set_data(0b00000000);
-    enable();
-    _set_data(0b00000110);
+    lcd->entry_mode = CMD_ENTRY_MODE | ENTRY_INCREMENT_BIT;
+    exec_instruction(lcd->entry_mode);
+
+    // Start from a known DDRAM content
+    clear_screen();
+
+    // And forget CGRAM's
+    for (aux = 0; aux < CGRAM_SLOTS; aux++){
+        lcd->cgram_glyph[aux] = NO_GLYPH;
+        lcd->cgram_lru[aux] = aux;
+    }
+    lcd->cgram_pending = 0;
+
+    // No trailing wait, the next transfer waits for the clear like for any other instruction
+
+}
+
+void warm_reset_lcd(void){
+
+#ifndef LCD_8BIT
+    byte i;
+#endif
+
+#ifdef LCD_ASYNC
+    lcd_flush();
+#endif
+
+    _set_RS_to_0();
+
+    // The LCD may be out of step with the nibbles, its busy flag can't be read yet
+#ifdef LCD_USE_RW
+    _lcd_delay_us(LONGEST_EXEC_US);
+#else
+    wait_ready();
+#endif
+
+#ifndef LCD_8BIT
+    // Three GOs bring the interface to 8 bit whatever half it was expecting, as in
+    // reset_lcd(), but the LCD is already powered so execution times are enough
+    for (i = 0; i < 3; i++){
+        _set_data_high(FUNCTION_SET_8BIT);
+        enable();
+        // The 1st one may complete a pending half into a clear or a return home
+        if (i) _warm_wait();
+        else _lcd_delay_us(LONGEST_EXEC_US);
+    }
+    _set_data_high(FUNCTION_SET_4BIT);
     enable();
+    _warm_wait();
+#endif
 
-    // Wait
-    _ini_wait4();
+    exec_instruction(FUNCTION_SET);
+    exec_instruction(lcd->display_control);
+    exec_instruction(lcd->entry_mode);
+
+    // A lost nibble may have moved the address counter, or completed into a return
+    // home and lost the display shift, which the viewport and marquee rely on
+    shift_restore();
+    sync_cursor();
 
 }
 
 void clear_screen(void){
+
+    byte i;
+
     exec_instruction(CMD_DISP_CLEAR);
+
+    for (i = 0; i < DDRAM_SIZE; i++)
+        lcd->ddram_shadow[i] = ' ';
+    for (i = 0; i < DDRAM_SIZE/8; i++)
+        lcd->ddram_dirty[i] = 0;
+    lcd->ddram_address = L1_START;
+    lcd->cursor_address = L1_START;
+    lcd->display_shift = 0;
+    lcd->marquee_tag = NO_MARQUEE;
+
+    _bus_flush();
+
 }
 
 void write_char(char ch){
+    shadow_put(lcd->cursor_address, ch);
+    lcd->cursor_address = _next_address(lcd->cursor_address);
+    shadow_commit();
+}
 
-    // Prepare data transfer
-    _set_RS_to_1();
+void send_char(char ch){
 
-    // 2nd half
-    _set_data(ch >> 4);
-    enable();
+    _stat_inc(bytes);
+    _stat_inc(chars);
 
-    // 1st half
-    _set_data(ch);
-    enable();
+#ifdef LCD_ASYNC
+    queue_push(1, ch);
+#else
+    bus_write(ch, 1);
 
-    // Disable data transfer
-    _set_RS_to_0();
+#ifndef LCD_USE_RW
+    _exec_wait(LCD_EXEC_WRITE_US);
+#endif
+#endif
+
+    if (lcd->entry_mode & ENTRY_INCREMENT_BIT) lcd->ddram_address = _next_address(lcd->ddram_address);
+    else lcd->ddram_address = _prev_address(lcd->ddram_address);
 
 }
 
 void exec_instruction(byte inst){
 
-    // 2nd half
-    _set_data(inst >> 4);
+    _stat_inc(bytes);
+    _stat_inc(instructions[instruction_class(inst)]);
+
+#ifdef LCD_ASYNC
+    queue_push(0, inst);
+#else
+    bus_write(inst, 0);
+
+#ifndef LCD_USE_RW
+    exec_wait(inst);
+#endif
+#endif
+
+}
+
+byte instruction_class(byte inst){
+
+    byte cls;
+
+    for (cls = INST_CLASS_DDRAM; cls && !(inst & (1 << cls)); cls--);
+    return cls;
+
+}
+
+#if !defined(LCD_USE_RW) && !defined(LCD_ASYNC)
+void exec_wait(byte inst){
+
+    // Wait only as long as the instruction's class needs
+    lcd->ready_at = lcd_clock_us + exec_classes[instruction_class(inst)];
+
+}
+#endif
+
+void bus_write(byte value, byte rs){
+
+    _wait_ready();
+
+#ifdef LCD_8BIT
+    _set_data_RS(value, rs);
+    enable();
+#else
+    // 2nd half, along with RS
+    _set_data_RS(value >> 4, rs);
     enable();
 
     // 1st half
-    _set_data(inst);
+    _set_data(value);
     enable();
-
-    // Wait 10 ms
-    _exec_wait();
+#endif
 
 }
 
 void enable(void){
-    _set_EN_to_1();
+    _stat_inc(nibbles);
+    _set_EN_to_1(lcd->e_mask);
+    _ena_wait1();
+    _set_EN_to_0(lcd->e_mask);
+    _ena_wait2();
+}
+
+unsigned int busy_left(void){
+
+#ifdef LCD_USE_RW
+    return read_busy(lcd->e_mask);
+#else
+    unsigned int left;
+
+    // Once lcd_clock_us is past ready_at the difference wraps around
+    left = lcd->ready_at - lcd_clock_us;
+    return left > LONGEST_EXEC_US ? 0 : left;
+#endif
+
+}
+
+#ifndef LCD_USE_RW
+void wait_ready(void){
+    while (busy_left() >= READY_STEP_US)
+        _lcd_delay_us(READY_STEP_US);
+    while (busy_left())
+        _lcd_delay_us(1);
+}
+#endif
+
+#ifdef LCD_USE_RW
+void wait_busy(void){
+    while (read_busy(lcd->e_mask));
+}
+
+byte read_busy(byte e_mask){
+
+    byte status;
+
+    // Read busy flag and address counter
+    _set_RS_to_0();
+    _data_as_input();
+    _set_RW_to_1();
+
+    // 2nd half, holds busy flag
+    _stat_inc(nibbles);
+    _set_EN_to_1(e_mask);
+    _ena_wait1();
+    status = _get_data();
+    _set_EN_to_0(e_mask);
+    _ena_wait2();
+
+#ifndef LCD_8BIT
+    // 1st half
+    _stat_inc(nibbles);
+    _set_EN_to_1(e_mask);
+    _ena_wait1();
+    _set_EN_to_0(e_mask);
+    _ena_wait2();
+#endif
+
+    _set_RW_to_0();
+    _data_as_output();
+
+    return status & BUSY_FLAG_READ_BIT;
+
+}
+
+byte read_data(void){
+
+    byte value;
+
+    wait_busy();
+
+    // Read the char at the address counter, which then moves as after a write
+    _set_RS_to_1();
+    _data_as_input();
+    _set_RW_to_1();
+
+    _stat_inc(nibbles);
+    _set_EN_to_1(lcd->e_mask);
+    _ena_wait1();
+    value = _get_data();
+    _set_EN_to_0(lcd->e_mask);
+    _ena_wait2();
+
+#ifndef LCD_8BIT
+    // 2nd half comes first
+    _stat_inc(nibbles);
+    _set_EN_to_1(lcd->e_mask);
     _ena_wait1();
-    _set_EN_to_0();
+    value = (value << 4) | (_get_data() & 0x0F);
+    _set_EN_to_0(lcd->e_mask);
     _ena_wait2();
+#endif
+
+    _set_RW_to_0();
+    _data_as_output();
+
+    if (lcd->entry_mode & ENTRY_INCREMENT_BIT) lcd->ddram_address = _next_address(lcd->ddram_address);
+    else lcd->ddram_address = _prev_address(lcd->ddram_address);
+
+    return value;
+
+}
+#endif
+
+#ifdef LCD_STATS
+void lcd_stats_snapshot(lcd_stats *stats){
+#if defined(LCD_ASYNC_ISR) && !defined(LCD_BUS_CUSTOM)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+    *stats = lcd_stats_counters;
+}
+
+void lcd_stats_reset(void){
+#if defined(LCD_ASYNC_ISR) && !defined(LCD_BUS_CUSTOM)
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+    memset(&lcd_stats_counters, 0, sizeof(lcd_stats_counters));
+}
+
+#if defined(LCD_ASYNC_ISR) && !defined(LCD_BUS_CUSTOM)
+void stat_add(unsigned long *counter, unsigned long n){
+    // 32 bit read-modify-write, which the ISR could otherwise interrupt halfway
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        *counter += n;
+}
+#endif
+#endif
+
+#ifdef LCD_BUS_CUSTOM
+void lcd_set_bus(const lcd_bus *bus){
+    lcd_bus_backend = bus;
+}
+#endif
+
+#ifdef LCD_ASYNC
+void queue_push(byte rs, byte value){
+
+    byte head, next;
+
+    head = queue_head;
+    next = (head + 1) & (LCD_QUEUE_SIZE - 1);
+
+    // Queue full, wait for lcd_service() to make room
+    while (next == queue_tail)
+        _service_tick();
+
+    queue_data[head] = value;
+    queue_e[head] = lcd->e_mask;
+    if (rs) queue_rs[head >> 3] |= 1 << (head & 0x07);
+    else queue_rs[head >> 3] &= ~(1 << (head & 0x07));
+
+    queue_head = next;
+
+}
+
+void lcd_service(void){
+
+    byte tail, value, rs, e_mask;
+
+    if (service_wait){
+        service_wait--;
+        return;
+    }
+
+    tail = queue_tail;
+    if (tail == queue_head) return;
+
+    value = queue_data[tail];
+    rs = queue_rs[tail >> 3] & (1 << (tail & 0x07));
+    e_mask = queue_e[tail];
+
+#ifndef LCD_8BIT
+    if (!service_half){
+
+#ifdef LCD_USE_RW
+        if (read_busy(e_mask)) return;
+#endif
+
+        // 2nd half
+        _set_data_RS(value >> 4, rs);
+        _ena_pulse(e_mask);
+        _bus_flush();
+        service_half = 1;
+        return;
+
+    }
+
+    // 1st half
+    _set_data(value);
+    _ena_pulse(e_mask);
+    service_half = 0;
+#else
+#ifdef LCD_USE_RW
+    if (read_busy(e_mask)) return;
+#endif
+
+    // Whole byte at once
+    _set_data_RS(value, rs);
+    _ena_pulse(e_mask);
+#endif
+
+#ifndef LCD_USE_RW
+    if (rs){
+        service_wait = _exec_ticks(LCD_EXEC_WRITE_US);
+    }else{
+        service_wait = exec_classes[instruction_class(value)];
+    }
+#endif
+
+    queue_tail = (tail + 1) & (LCD_QUEUE_SIZE - 1);
+    _bus_flush();
+
+}
+
+byte lcd_queue_depth(void){
+    return (queue_head - queue_tail) & (LCD_QUEUE_SIZE - 1);
+}
+
+void lcd_flush(void){
+    while (queue_head != queue_tail || service_wait)
+        _service_tick();
+}
+#else
+void lcd_flush(void){
+    _bus_flush();
+    _wait_ready();
 }
+#endif
 
 void gotoaddress(byte address){
-    exec_instruction(address | SET_ADDRESS);
+    if (!_valid_address(address)) return;
+    lcd->cursor_address = address;
+    sync_cursor();
 }
 
 void gohome(void){
     exec_instruction(CMD_RET_HOME);
+    _bus_flush();
+    lcd->ddram_address = L1_START;
+    lcd->cursor_address = L1_START;
+    lcd->display_shift = 0;
 }
 
 void switch_display(byte on){
-    if (on) exec_instruction(CMD_DISP_ON);
-    else exec_instruction(CMD_DISP_OFF);
+    lcd->display_control = on ? CMD_DISP_ON : CMD_DISP_OFF;
+    exec_instruction(lcd->display_control);
+    _bus_flush();
 }
 
 void move_cursor_right(byte times){
-    byte i;
-    for (i = 0; i < times; i++)
-        exec_instruction(CMD_CURSOR_RIGHT);
+    lcd->cursor_address = _ddram_address( (_ddram_index(lcd->cursor_address) + times) % DDRAM_SIZE );
+    sync_cursor();
 }
 
 void move_cursor_left(byte times){
-    byte i;
-    for (i = 0; i < times; i++)
-        exec_instruction(CMD_CURSOR_LEFT);
+    lcd->cursor_address = _ddram_address( (_ddram_index(lcd->cursor_address) + DDRAM_SIZE - times % DDRAM_SIZE) % DDRAM_SIZE );
+    sync_cursor();
 }
 
 void move_screen_left(byte times){
-    byte i;
-    for (i = 0; i < times; i++)
-        exec_instruction(CMD_DISP_RIGHT);
+    shift_display_to( (lcd->display_shift + ROW_LENGTH - times % ROW_LENGTH) % ROW_LENGTH );
 }
 
 void move_screen_right(byte times){
-    byte i;
-    for (i = 0; i < times; i++)
-        exec_instruction(CMD_DISP_LEFT);
+    shift_display_to( (lcd->display_shift + times) % ROW_LENGTH );
+}
+
+void shift_display_to(byte shift){
+
+    byte n;
+
+    // Shifting is circular, go whichever way is shorter
+    n = (shift + ROW_LENGTH - lcd->display_shift) % ROW_LENGTH;
+
+    // Unless a return home is shorter still
+    if (!shift && (n <= ROW_LENGTH/2 ? n : ROW_LENGTH - n)*SHIFT_COST_US > HOME_COST_US){
+        exec_instruction(CMD_RET_HOME);
+        lcd->ddram_address = L1_START;
+        lcd->display_shift = 0;
+        sync_cursor();
+        return;
+    }
+
+    if (n <= ROW_LENGTH/2){
+        for (; n; n--)
+            exec_instruction(CMD_DISP_LEFT);
+    }else{
+        for (n = ROW_LENGTH - n; n; n--)
+            exec_instruction(CMD_DISP_RIGHT);
+    }
+    _bus_flush();
+
+    lcd->display_shift = shift;
+
+}
+
+void shift_restore(void){
+
+    byte shift;
+
+    // Shifts are relative, only a return home leaves the LCD at a known one
+    shift = lcd->display_shift;
+    exec_instruction(CMD_RET_HOME);
+    lcd->ddram_address = L1_START;
+    lcd->display_shift = 0;
+    shift_display_to(shift);
+
 }
 
 void erase_line(byte start_address){
-    byte i;
-    gotoaddress(start_address);
-    for (i = 0; i < DISPLAY_WIDTH; i++)
-        write_char(' ');
-    gotoaddress(start_address);
+
+    byte i, address;
+
+    address = start_address;
+    for (i = 0; i < DISPLAY_WIDTH; i++){
+        shadow_put(address, ' ');
+        address = _next_address(address);
+    }
+
+    lcd->cursor_address = start_address;
+    shadow_commit();
+
 }
 
-void write_text(char str[], byte start_address, byte jump){
+byte row_col_address(byte row, byte col){
 
-    byte len, i, next_address;
-    len = strlen(str);
+    byte index, line;
 
-    gotoaddress(start_address);
+    if (row >= LCD_ROWS) return ADDRESS_UNKNOWN;
 
-    if (!jump){
+    // The viewport starts display_shift chars into every DDRAM line
+    index = _ddram_index(row_start[row]);
+    line = _ddram_line(row_start[row]);
 
-        for (i = 0; i < len; i++)
-            write_char(str[i]);
+    return _ddram_address( line + (index - line + col + lcd->display_shift) % ROW_LENGTH );
 
-    }else{
+}
 
-        if (len > DISPLAY_WIDTH*2)
-		    len = DISPLAY_WIDTH*2;
+void gotorowcol(byte row, byte col){
+    gotoaddress(row_col_address(row, col));
+}
 
-        next_address = start_address >= L2_START ? start_address - L1_START : start_address + L2_START;
+byte canvas_address(byte row, byte col){
+    if (row >= LCD_ROWS || col >= CANVAS_WIDTH) return ADDRESS_UNKNOWN;
+    return row_start[row] + col;
+}
 
-        for (i = 0; i < len; i++){
-            if (i == DISPLAY_WIDTH) gotoaddress(next_address);
-            write_char(str[i]);
-        }
+void write_canvas(char str[], byte row, byte col){
 
-    }
+    put_begin(canvas_address(row, col), 0);
+#ifdef LCD_UTF8
+    for (; *str && col < CANVAS_WIDTH; str++)
+        col += put_utf8(*str);
+#else
+    for (; *str && col < CANVAS_WIDTH; col++)
+        put_char(*str++);
+#endif
+    put_end();
 
 }
 
-byte register_text_unit(char str[], byte window_size, byte jump){
+void pan_to(byte col){
+    shift_display_to(col % ROW_LENGTH);
+}
 
-    byte i, len;
+byte pan_position(void){
+    return lcd->display_shift;
+}
 
-    len = strlen(str);
-    if (window_size <= 0 || window_size > len) window_size = len;
+byte address_row(byte address){
 
-    // Register text unit
-    tags[last_unit_available].start_address   = L1_START;
-    tags[last_unit_available].size            = len;
-    tags[last_unit_available].window_size     = window_size;
-    tags[last_unit_available].offset          = 0;
-    tags[last_unit_available].jump            = jump;
+    byte row;
 
-    // Write text unit into text_units matrix
-    for (i = 0; i < len && i < TEXT_UNIT_MAX_LEN; i++)
-        units[last_unit_available][i] = str[i];
+    for (row = 0; row < LCD_ROWS; row++)
+        if ((byte)(address - row_start[row]) < LCD_COLS) return row;
 
-    last_unit_available = (last_unit_available + 1)%TEXT_UNITS_AMT;
-    return last_unit_available-1;
+    // Off screen, take the row owning that DDRAM line
+    return _ddram_index(address) >= ROW_LENGTH ? 1 : 0;
 
 }
 
-void write_text_unit(byte tag, byte start_address){
+void write_text(char str[], byte start_address, byte jump){
+
+    put_begin(start_address, jump);
+    while (*str)
+        _put_text_char(*str++);
+    put_end();
 
-    byte i, index;
-    char aux_array[ROW_LENGTH];
+}
 
-    index = tags[tag].offset;
+void write_text_P(PGM_P str, byte start_address, byte jump){
 
-    for (i = 0; i < tags[tag].window_size; i++){
-        aux_array[i] = units[tag][index];
-        index = (index+1)%(tags[tag].size);
-    }
-    aux_array[tags[tag].window_size] = '\0';
+    char ch;
 
-    write_text(aux_array, start_address, tags[tag].jump);
+    // Straight from flash into the DDRAM mirror
+    put_begin(start_address, jump);
+    while ((ch = pgm_read_byte(str++)))
+        _put_text_char(ch);
+    put_end();
 
 }
 
-void move_text_unit(byte tag, byte start_address){
+void put_begin(byte start_address, byte jump){
 
-    toggle_text_unit(tag, 0);
-    tags[tag].start_address = start_address;
-    write_text_unit(tag, start_address);
+    put_address = start_address;
+    put_jump = jump;
+    put_count = 0;
+#ifdef LCD_UTF8
+    utf8_left = 0;
+#endif
+
+    if (jump){
+        put_row = address_row(start_address);
+        put_col = start_address - row_start[put_row];
+    }
 
 }
 
-void toggle_text_unit(byte tag, byte on){
+void put_char(char ch){
 
-    byte i, index;
-    char aux_array[ROW_LENGTH];
+    // Texts starting outside DDRAM are dropped
+    if (!_valid_address(put_address)) return;
 
-    index = tags[tag].offset;
+    if (put_jump){
 
-    if (on){
-        for (i = 0; i < tags[tag].window_size; i++){
-            aux_array[i] = units[tag][index];
-            index = (index+1)%(tags[tag].size);
+        if (put_count == DISPLAY_WIDTH*LCD_ROWS) return;
+
+        // Rows are laid in DDRAM order by the flush, so SET_ADDRESS is only
+        // sent where DDRAM is not contiguous (e.g. rows 1 to 3 of a 20x4 are)
+        if (put_count && put_count % DISPLAY_WIDTH == 0){
+            put_row = (put_row + 1) % LCD_ROWS;
+            put_address = row_start[put_row] + put_col;
         }
-    }else{
-        for (i = 0; i < tags[tag].window_size; i++)
-            aux_array[i] = ' ';
+        put_count++;
+
     }
 
-    aux_array[tags[tag].window_size] = '\0';
-    write_text(aux_array, tags[tag].start_address, tags[tag].jump);
+    shadow_put(put_address, ch);
+    put_address = _next_address(put_address);
 
 }
 
-void rotate_text_unit(byte tag, byte direction, byte stride){
+#ifdef LCD_UTF8
+byte put_utf8(char ch){
 
-    byte size, i, index;
-    char aux_array[ROW_LENGTH];
+    if (!utf8_decode(ch)) return FALSE;
 
-    size = tags[tag].size;
-    tags[tag].offset = direction == LEFT ? (tags[tag].offset+stride)%size : (tags[tag].offset+size-1)%size;
-    index = tags[tag].offset;
+    put_char(rom_char(utf8_code));
+    return TRUE;
+
+}
+
+byte utf8_decode(char ch){
+
+    byte b;
+
+    b = ch;
+
+    if (b >= 0x80 && b < 0xC0){
+
+        // Continuation byte, stray ones are dropped
+        if (!utf8_left) return FALSE;
+        utf8_code = (utf8_code << 6) | (b & 0x3F);
+        if (--utf8_left) return FALSE;
+
+    }else{
+
+        // A new sequence cuts short an unfinished one
+        if (b < 0x80)       utf8_code = b;
+        else if (b < 0xE0)  { utf8_code = b & 0x1F; utf8_left = 1; return FALSE; }
+        else if (b < 0xF0)  { utf8_code = b & 0x0F; utf8_left = 2; return FALSE; }
+        else                { utf8_code = b & 0x07; utf8_left = 3; return FALSE; }
+        utf8_left = 0;
 
-    for (i = 0; i < tags[tag].window_size; i++){
-        aux_array[i] = units[tag][index];
-        index = (index+1) % size;
     }
 
-    aux_array[tags[tag].window_size] = '\0';
-    write_text(aux_array, tags[tag].start_address, tags[tag].jump);
+    return TRUE;
 
 }
 
-void return_text_unit_to_initial_position(byte tag){
+byte utf8_chars(const char *str, byte len, byte flash){
+
+    byte i, chars;
+
+    // Every byte but continuation bytes starts a char
+    chars = 0;
+    for (i = 0; i < len; i++)
+        if (!_utf8_continuation(flash ? pgm_read_byte(str + i) : str[i])) chars++;
+
+    return chars;
+
+}
+
+byte unit_char_pos(byte slot, byte index){
+
+    byte pos;
+
+    // Byte where the unit's char "index" starts
+    for (pos = 0; ; pos++)
+        if (!_utf8_continuation(_unit_char(slot, pos)) && !index--) return pos;
+
+}
+
+byte unit_next(byte slot, byte pos){
+
+    // Past the char's continuation bytes, back to the first char after the last one
+    do{
+        if (++pos == lcd->tags[slot].length) return unit_char_pos(slot, 0);
+    }while (_utf8_continuation(_unit_char(slot, pos)));
 
-    byte size, i, index;
-    char aux_array[ROW_LENGTH];
+    return pos;
+
+}
+
+char unit_rom_char(byte slot, byte pos){
+
+    byte done;
+
+    // The char's bytes, "#" if they are not a whole UTF-8 sequence
+    utf8_left = 0;
+    done = utf8_decode(_unit_char(slot, pos));
+    while (!done && ++pos < lcd->tags[slot].length && _utf8_continuation(_unit_char(slot, pos)))
+        done = utf8_decode(_unit_char(slot, pos));
+
+    return done ? rom_char(utf8_code) : '#';
+
+}
 
-    size = tags[tag].size;
-    tags[tag].offset = 0;
-    index = tags[tag].offset;
+char rom_char(unsigned long code_point){
+
+    byte low, high, middle, i;
+    unsigned int entry;
+
+    if (code_point < 0x80 && (code_point < 0x20 || !ROM_ASCII_MISSING(code_point)))
+        return code_point;
+    if (code_point >= ROM_RUN_FIRST && code_point <= ROM_RUN_LAST)
+        return ROM_RUN_CODE + (code_point - ROM_RUN_FIRST);
+
+    // Binary search of the ROM's table
+    low = 0;
+    high = ROM_CHARS_AMT;
+    while (low < high){
+        middle = (low + high) / 2;
+        entry = pgm_read_word(&rom_chars[middle].code_point);
+        if (entry == code_point) return pgm_read_byte(&rom_chars[middle].code);
+        if (entry < code_point) low = middle + 1;
+        else high = middle;
+    }
 
-    for (i = 0; i < tags[tag].window_size; i++){
-        aux_array[i] = units[tag][index];
-        index = (index+1)%size;
+    // Then of the application's glyphs
+    for (i = 0; i < glyph_map_amount; i++){
+        if (pgm_read_word(&glyph_map[i].code_point) != code_point) continue;
+        i = glyph_char(pgm_read_byte(&glyph_map[i].code));
+        return i == NO_GLYPH ? '#' : (char)i;
     }
 
-    aux_array[tags[tag].window_size] = '\0';
-    write_text(aux_array, tags[tag].start_address, tags[tag].jump);
+    return '#';
 
 }
+#endif
 
-void replace_chars_in_text_unit(byte tag, byte *offsets, char *chars, byte num_offsets){
+void put_end(void){
+    if (_valid_address(put_address)) lcd->cursor_address = put_address;
+    shadow_commit();
+}
 
-    byte size, i, index, chars_replaced;
-    char aux_array[ROW_LENGTH];
+void shadow_put(byte address, char ch){
 
-    // Rewrite text unit
+    byte index;
 
-    size = tags[tag].size;
-    index = tags[tag].offset;
-    chars_replaced = 0;
+    // Out of DDRAM, e.g. a bar or a field running past the end of its row
+    if (!_valid_address(address)) return;
 
-    for (i = 0; i < tags[tag].window_size; i++){
+    index = _ddram_index(address);
+    if (lcd->ddram_shadow[index] == ch) return;
 
-        if (chars_replaced < num_offsets && index == offsets[chars_replaced]){
-            aux_array[i] = chars[chars_replaced];
-            chars_replaced++;
-        }else{
-            aux_array[i] = units[tag][index];
+    lcd->ddram_shadow[index] = ch;
+    lcd->ddram_dirty[index >> 3] |= 1 << (index & 0x07);
+
+}
+
+byte shadow_flush(unsigned int budget_us){
+
+    byte i, index, gap;
+    unsigned int spent, cost;
+
+    if (lcd->cgram_pending) cgram_upload();
+
+    // Send dirty cells in runs, letting the LCD's address counter auto-increment
+    // between them. Short gaps of clean cells are rewritten rather than paying
+    // for a new SET_ADDRESS instruction. Start where the last flush cut short
+    // stopped, so that no cell waits forever.
+    spent = 0;
+    for (i = 0; i < DDRAM_SIZE; i++){
+
+        index = (lcd->flush_start + i) % DDRAM_SIZE;
+        if (!(lcd->ddram_dirty[index >> 3] & (1 << (index & 0x07)))) continue;
+
+        gap = _ddram_index(lcd->ddram_address);
+        gap = index >= gap ? index - gap : SHADOW_BRIDGE_GAP + 1;
+
+        // Leave the rest for next time once the budget is used up, but always make progress
+        cost = (gap > SHADOW_BRIDGE_GAP ? ADDRESS_COST_US : gap*CHAR_COST_US) + CHAR_COST_US;
+        if (budget_us && spent && spent + cost > budget_us){
+            lcd->flush_start = index;
+            _bus_flush();
+            return FALSE;
         }
+        spent += cost;
 
-        index = (index+1) % size;
+        if (gap > SHADOW_BRIDGE_GAP)
+            set_address(_ddram_address(index));
+        else
+            while (gap--)
+                send_char(lcd->ddram_shadow[_ddram_index(lcd->ddram_address)]);
+
+        send_char(lcd->ddram_shadow[index]);
+        lcd->ddram_dirty[index >> 3] &= ~(1 << (index & 0x07));
 
     }
 
-    aux_array[tags[tag].window_size] = '\0';
-    write_text(aux_array, tags[tag].start_address, tags[tag].jump);
+    // All sent, the next frame starts from the top rather than where this one was cut
+    lcd->flush_start = 0;
+    sync_cursor();
+
+    return TRUE;
+
+}
+
+byte shadow_pending(void){
+
+    byte i;
+
+    for (i = 0; i < DDRAM_SIZE/8; i++)
+        if (lcd->ddram_dirty[i]) return TRUE;
+    return FALSE;
+
+}
 
-}
\ No newline at end of file
+void shadow_commit(void){
+    if (!lcd->frame_mode) shadow_flush(0);
+}
+
+void set_address(byte address){
+    if (address == lcd->ddram_address) return;
+    exec_instruction(address | SET_ADDRESS);
+    lcd->ddram_address = address;
+}
+
+void sync_cursor(void){
+    // Only a visible cursor needs the address counter to be where the caller expects it
+    if (lcd->display_control & (CURSOR_BIT | CURSORBLINK_BIT))
+        set_address(lcd->cursor_address);
+    // Calls that send something end here, or flush the backend themselves
+    _bus_flush();
+}
+
+byte register_text_unit(char str[], byte window_size, byte jump){
+
+    byte i, slot;
+    size_t len;
+
+    // Longer than the whole arena, it would not fit even once compacted
+    len = strlen(str);
+    if (len > TEXT_ARENA_SIZE) return NO_UNIT;
+
+    if ((size_t)(TEXT_ARENA_SIZE - lcd->arena_used) < len) compact_text_units();
+    if ((size_t)(TEXT_ARENA_SIZE - lcd->arena_used) < len) return NO_UNIT;
+
+    slot = unit_new(len, _text_chars(str, len, FALSE), window_size, jump);
+    if (slot == NO_UNIT) return NO_UNIT;
+
+    // Append text unit to the arena, at its actual length
+    lcd->tags[slot].arena_start = lcd->arena_used;
+    for (i = 0; i < len; i++)
+        lcd->arena[lcd->arena_used++] = str[i];
+
+    return _unit_handle(slot);
+
+}
+
+byte register_text_unit_P(PGM_P str, byte window_size, byte jump){
+
+    byte slot;
+    size_t len;
+
+    // Read from flash every time it is shown, no RAM copy, but counted in a byte
+    len = strlen_P(str);
+    if (len > UNIT_MAX_LEN) return NO_UNIT;
+
+    slot = unit_new(len, _text_chars(str, len, TRUE), window_size, jump);
+    if (slot == NO_UNIT) return NO_UNIT;
+
+    lcd->tags[slot].flash_text = str;
+    return _unit_handle(slot);
+
+}
+
+byte unit_new(byte len, byte chars, byte window_size, byte jump){
+
+    byte slot;
+
+    if (!chars) return NO_UNIT;
+    if (window_size <= 0 || window_size > chars) window_size = chars;
+
+    for (slot = 0; slot < TEXT_UNITS_AMT && lcd->tags[slot].size; slot++);
+    if (slot == TEXT_UNITS_AMT) return NO_UNIT;
+
+    // Register text unit
+    lcd->tags[slot].start_address   = L1_START;
+    lcd->tags[slot].size            = chars;
+    lcd->tags[slot].length          = len;
+    lcd->tags[slot].window_size     = window_size;
+    lcd->tags[slot].offset          = 0;
+    lcd->tags[slot].jump            = jump;
+    lcd->tags[slot].marquee         = 0;
+    lcd->tags[slot].flash_text      = 0;
+    lcd->effects[slot].type         = EFFECT_NONE;
+
+    return slot;
+
+}
+
+void unregister_text_unit(byte tag){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->marquee_tag == slot){
+        shift_display_to(0);
+        lcd->marquee_tag = NO_MARQUEE;
+    }
+
+    // Old handles stop matching, the arena space is reclaimed by the next compaction
+    lcd->tags[slot].size = 0;
+    lcd->tags[slot].generation = (lcd->tags[slot].generation + 1) & 0x0F;
+    lcd->effects[slot].type = EFFECT_NONE;
+
+}
+
+byte unit_slot(byte tag){
+
+    byte slot;
+
+    slot = tag & 0x0F;
+    if (slot >= TEXT_UNITS_AMT || !lcd->tags[slot].size || lcd->tags[slot].generation != tag >> 4)
+        return NO_UNIT;
+    return slot;
+
+}
+
+void compact_text_units(void){
+
+    byte slot, next, used, i;
+
+    // Slide live units down in arena order, closing the gaps left by unregistered ones
+    used = 0;
+    for (;;){
+
+        next = NO_UNIT;
+        for (slot = 0; slot < TEXT_UNITS_AMT; slot++)
+            if (lcd->tags[slot].size && !lcd->tags[slot].flash_text && lcd->tags[slot].arena_start >= used &&
+                (next == NO_UNIT || lcd->tags[slot].arena_start < lcd->tags[next].arena_start))
+                next = slot;
+        if (next == NO_UNIT) break;
+
+        for (i = 0; i < lcd->tags[next].length; i++)
+            lcd->arena[used + i] = lcd->arena[lcd->tags[next].arena_start + i];
+        lcd->tags[next].arena_start = used;
+        used += lcd->tags[next].length;
+
+    }
+
+    lcd->arena_used = used;
+
+}
+
+void write_text_unit(byte tag, byte start_address){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->marquee_tag == slot) marquee_stop();
+    unit_put(slot, start_address, TRUE);
+
+}
+
+void unit_put(byte slot, byte start_address, byte on){
+
+    byte i, pos;
+
+    // Show the unit's window, or blanks over it
+    pos = _unit_char_pos(slot, lcd->tags[slot].offset);
+    put_begin(start_address, lcd->tags[slot].jump);
+
+    for (i = 0; i < lcd->tags[slot].window_size; i++){
+        put_char(on ? _unit_rom_char(slot, pos) : ' ');
+        pos = _unit_next(slot, pos);
+    }
+
+    put_end();
+
+}
+
+void move_text_unit(byte tag, byte start_address){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    toggle_text_unit(tag, 0);
+    lcd->tags[slot].start_address = start_address;
+    write_text_unit(tag, start_address);
+
+}
+
+void toggle_text_unit(byte tag, byte on){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->marquee_tag == slot) marquee_stop();
+    unit_put(slot, lcd->tags[slot].start_address, on);
+
+}
+
+void rotate_text_unit(byte tag, byte direction, byte stride){
+
+    byte size, slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    size = lcd->tags[slot].size;
+
+    if (marquee_fits(slot)){
+        if (lcd->marquee_tag != slot) marquee_start(slot);
+        stride %= ROW_LENGTH;
+        shift_display_to( direction == LEFT ? (lcd->display_shift + stride) % ROW_LENGTH : (lcd->display_shift + ROW_LENGTH - stride) % ROW_LENGTH );
+        lcd->tags[slot].offset = direction == LEFT ? (lcd->tags[slot].offset+stride)%size : (lcd->tags[slot].offset+size-stride%size)%size;
+        return;
+    }
+    if (lcd->marquee_tag == slot) marquee_stop();
+
+    lcd->tags[slot].offset = direction == LEFT ? (lcd->tags[slot].offset+stride)%size : (lcd->tags[slot].offset+size-stride%size)%size;
+    unit_put(slot, lcd->tags[slot].start_address, TRUE);
+
+}
+
+void return_text_unit_to_initial_position(byte tag){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->marquee_tag == slot) marquee_stop();
+
+    lcd->tags[slot].offset = 0;
+    unit_put(slot, lcd->tags[slot].start_address, TRUE);
+
+}
+
+void replace_chars_in_text_unit(byte tag, byte *offsets, char *chars, byte num_offsets){
+
+    byte size, i, index, pos, chars_replaced, slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->marquee_tag == slot) marquee_stop();
+
+    // Rewrite text unit
+
+    size = lcd->tags[slot].size;
+    index = lcd->tags[slot].offset;
+    pos = _unit_char_pos(slot, index);
+    chars_replaced = 0;
+    put_begin(lcd->tags[slot].start_address, lcd->tags[slot].jump);
+
+    for (i = 0; i < lcd->tags[slot].window_size; i++){
+
+        if (chars_replaced < num_offsets && index == offsets[chars_replaced]){
+            put_char(chars[chars_replaced]);
+            chars_replaced++;
+        }else{
+            put_char(_unit_rom_char(slot, pos));
+        }
+
+        index = (index+1) % size;
+        pos = _unit_next(slot, pos);
+
+    }
+
+    put_end();
+
+}
+
+void set_text_unit_marquee(byte tag, byte on){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    lcd->tags[slot].marquee = on;
+    if (!on && lcd->marquee_tag == slot) write_text_unit(tag, lcd->tags[slot].start_address);
+}
+
+byte marquee_fits(byte slot){
+
+    byte row, start_col, i;
+
+#if LCD_ROWS > 2
+    // Rows 3 and 4 continue rows 1 and 2, so a DDRAM line cannot scroll as a single row
+    return FALSE;
+#endif
+
+    if (!lcd->tags[slot].marquee || lcd->tags[slot].jump || lcd->tags[slot].size > ROW_LENGTH) return FALSE;
+    if (lcd->marquee_tag != NO_MARQUEE && lcd->marquee_tag != slot) return FALSE;
+
+    // Display shift moves every row, so nothing but the unit may be shown
+    row = _ddram_line(lcd->tags[slot].start_address);
+    start_col = _ddram_index(lcd->tags[slot].start_address) - row;
+
+    for (i = 0; i < DDRAM_SIZE; i++){
+        if (i >= row && i < row + ROW_LENGTH &&
+            (i - row + ROW_LENGTH - start_col) % ROW_LENGTH < lcd->tags[slot].size) continue;
+        if (lcd->ddram_shadow[i] != ' ') return FALSE;
+    }
+
+    return TRUE;
+
+}
+
+void marquee_start(byte slot){
+
+    byte row, start_col, i, pos;
+
+    // Lay the whole unit out along its row, starting with the char now shown first
+    row = _ddram_line(lcd->tags[slot].start_address);
+    start_col = _ddram_index(lcd->tags[slot].start_address) - row;
+    pos = _unit_char_pos(slot, lcd->tags[slot].offset);
+
+    for (i = 0; i < lcd->tags[slot].size; i++){
+        shadow_put(_ddram_address(row + (start_col + i) % ROW_LENGTH), _unit_rom_char(slot, pos));
+        pos = _unit_next(slot, pos);
+    }
+    shadow_commit();
+
+    lcd->marquee_tag = slot;
+
+}
+
+void marquee_stop(void){
+
+    byte row, start_col, i;
+
+    // Back to an unshifted display, the caller rewrites the unit's window
+    shift_display_to(0);
+
+    row = _ddram_line(lcd->tags[lcd->marquee_tag].start_address);
+    start_col = _ddram_index(lcd->tags[lcd->marquee_tag].start_address) - row;
+
+    for (i = 0; i < lcd->tags[lcd->marquee_tag].size; i++)
+        shadow_put(_ddram_address(row + (start_col + i) % ROW_LENGTH), ' ');
+
+    lcd->marquee_tag = NO_MARQUEE;
+
+}
+
+void set_text_unit_rotation(byte tag, byte direction, byte stride, unsigned int period, unsigned int now){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    lcd->effects[slot].type       = EFFECT_ROTATE;
+    lcd->effects[slot].direction  = direction;
+    lcd->effects[slot].stride     = stride;
+    lcd->effects[slot].period     = period;
+    lcd->effects[slot].due        = now + period;
+}
+
+void set_text_unit_blink(byte tag, unsigned int period, unsigned int on_time, unsigned int now){
+
+    byte slot;
+
+    // The unit must be both shown and hidden for some time, period - on_time would wrap otherwise
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT || !on_time || on_time >= period) return;
+
+    lcd->effects[slot].type       = EFFECT_BLINK;
+    lcd->effects[slot].period     = period;
+    lcd->effects[slot].on_time    = on_time;
+    lcd->effects[slot].shown      = TRUE;
+    lcd->effects[slot].due        = now + on_time;
+}
+
+void clear_text_unit_effect(byte tag){
+
+    byte slot;
+
+    slot = unit_slot(tag);
+    if (slot == NO_UNIT) return;
+
+    if (lcd->effects[slot].type == EFFECT_BLINK && !lcd->effects[slot].shown){
+        lcd->effects[slot].type = EFFECT_NONE;
+        toggle_text_unit(tag, 1);
+    }
+    lcd->effects[slot].type = EFFECT_NONE;
+}
+
+void set_frame_mode(byte on){
+    lcd->frame_mode = on;
+}
+
+void set_frame_budget(unsigned int budget_us){
+    lcd->frame_budget_us = budget_us;
+}
+
+byte lcd_tick(unsigned int now){
+
+    byte slot, previous_mode;
+
+    // Render every effect that is due into the DDRAM mirror only
+    previous_mode = lcd->frame_mode;
+    lcd->frame_mode = TRUE;
+
+    for (slot = 0; slot < TEXT_UNITS_AMT; slot++){
+
+        if (lcd->effects[slot].type == EFFECT_NONE || (int)(now - lcd->effects[slot].due) < 0) continue;
+
+        if (lcd->effects[slot].type == EFFECT_ROTATE){
+            rotate_text_unit(_unit_handle(slot), lcd->effects[slot].direction, lcd->effects[slot].stride);
+            lcd->effects[slot].due += lcd->effects[slot].period;
+        }else{
+            lcd->effects[slot].shown = !lcd->effects[slot].shown;
+            toggle_text_unit(_unit_handle(slot), lcd->effects[slot].shown);
+            lcd->effects[slot].due += lcd->effects[slot].shown ? lcd->effects[slot].on_time : lcd->effects[slot].period - lcd->effects[slot].on_time;
+        }
+
+        // Skip frames rather than trying to catch up after a long stall
+        if ((int)(now - lcd->effects[slot].due) >= 0) lcd->effects[slot].due = now + lcd->effects[slot].period;
+
+    }
+
+    lcd->frame_mode = previous_mode;
+
+    // Then send what changed, all effects and updates since last tick merged
+    if (!shadow_flush(lcd->frame_budget_us)) return FALSE;
+
+    if (lcd->scrub_budget_us) lcd_scrub();
+    return TRUE;
+
+}
+
+void set_scrub_budget(unsigned int budget_us){
+    lcd->scrub_budget_us = budget_us;
+}
+
+byte lcd_scrub(void){
+
+    byte step, cell, row, address, cgram_next;
+    unsigned int spent, cost;
+#if defined(LCD_USE_RW) && !defined(LCD_ASYNC)
+    byte reading;
+
+    reading = FALSE;
+#endif
+
+    // Noise may have moved the address counter too
+    lcd->ddram_address = ADDRESS_UNKNOWN;
+    cgram_next = ADDRESS_UNKNOWN;
+    spent = 0;
+
+    do{
+
+        step = lcd->scrub_step;
+        cell = step - SCRUB_CELLS;              // Index in ddram_shadow
+        row = step - SCRUB_GLYPHS;              // CGRAM address, glyph rows of every slot in a row
+        address = _ddram_address(cell);
+
+        // Cells waiting for a flush, and free CGRAM slots, cost nothing
+        if (step == SCRUB_MODES){
+            cost = MODES_COST_US;
+        }else if (step == SCRUB_SHIFT){
+            // Noise may have shifted an unshifted display too, see shift_restore()
+            cell = lcd->display_shift <= ROW_LENGTH/2 ? lcd->display_shift : ROW_LENGTH - lcd->display_shift;
+            cost = HOME_COST_US + cell*SHIFT_COST_US;
+        }else if (step < SCRUB_GLYPHS){
+            if (lcd->ddram_dirty[cell >> 3] & (1 << (cell & 0x07))) cost = 0;
+#if defined(LCD_USE_RW) && !defined(LCD_ASYNC)
+            // Reading back needs a SET_ADDRESS after any write, and may find a cell to repair
+            else cost = (reading && lcd->ddram_address == address ? 0 : ADDRESS_COST_US) +
+                        READ_COST_US + ADDRESS_COST_US + CHAR_COST_US;
+#else
+            else cost = (lcd->ddram_address == address ? 0 : ADDRESS_COST_US) + CHAR_COST_US;
+#endif
+        }else{
+            cost = lcd->cgram_glyph[row >> 3] == NO_GLYPH ? 0 :
+                   (cgram_next == row ? 0 : ADDRESS_COST_US) + CHAR_COST_US;
+        }
+
+        // Always make progress
+        if (lcd->scrub_budget_us && spent && spent + cost > lcd->scrub_budget_us) break;
+        spent += cost;
+
+        if (!cost){
+            // Nothing to refresh
+        }else if (step == SCRUB_MODES){
+            // First, so that the entry mode is right for the writes that follow
+            exec_instruction(FUNCTION_SET);
+            exec_instruction(lcd->display_control);
+            exec_instruction(lcd->entry_mode);
+        }else if (step == SCRUB_SHIFT){
+            shift_restore();
+        }else if (step < SCRUB_GLYPHS){
+#if defined(LCD_USE_RW) && !defined(LCD_ASYNC)
+            if (!reading || lcd->ddram_address != address){
+                exec_instruction(address | SET_ADDRESS);
+                lcd->ddram_address = address;
+            }
+            reading = read_data() == (byte)lcd->ddram_shadow[cell];
+            if (reading){
+                // No repair needed
+                spent -= ADDRESS_COST_US + CHAR_COST_US;
+            }else{
+                exec_instruction(address | SET_ADDRESS);
+                lcd->ddram_address = address;
+                send_char(lcd->ddram_shadow[cell]);
+            }
+#else
+            set_address(address);
+            send_char(lcd->ddram_shadow[cell]);
+#endif
+        }else{
+            if (cgram_next != row) exec_instruction(SET_CGRAM_ADDRESS | row);
+            send_char(glyph_row(lcd->cgram_glyph[row >> 3], row & 0x07));
+            cgram_next = row + 1;
+            lcd->ddram_address = ADDRESS_UNKNOWN;
+        }
+
+        lcd->scrub_step = (step + 1) % SCRUB_STEPS;
+
+    }while (lcd->scrub_step);
+
+    sync_cursor();
+
+    return !lcd->scrub_step;
+
+}
+
+void lcd_setup_display(lcd_display *display, byte e_bit){
+    memset(display, 0, sizeof(lcd_display));
+    display->marquee_tag = NO_MARQUEE;
+    display->e_mask = 1 << e_bit;
+    lcd = display;
+}
+
+void lcd_select(lcd_display *display){
+    lcd = display;
+}
+
+void lcd_refresh(lcd_display *displays[], byte amount){
+
+    byte i, pending, sent;
+    unsigned int left, wait;
+    lcd_display *selected;
+
+    selected = lcd;
+
+    // Send one cell to each display that is ready, and only wait when none is
+    do{
+
+        pending = FALSE;
+        sent = FALSE;
+        wait = READY_STEP_US;
+
+        for (i = 0; i < amount; i++){
+
+            lcd = displays[i];
+            if (!shadow_pending()) continue;
+            pending = TRUE;
+
+            left = busy_left();
+            if (left){
+                if (left < wait) wait = left;
+                continue;
+            }
+
+            shadow_flush(1);
+            sent = TRUE;
+
+        }
+
+        if (pending && !sent){
+            if (wait >= READY_STEP_US) _lcd_delay_us(READY_STEP_US);
+            else _lcd_delay_us(1);
+        }
+
+    }while (pending);
+
+    lcd = selected;
+
+}
+
+void set_glyph_table(const byte *table, byte amount){
+    glyph_table = table;
+    glyph_amount = amount;
+}
+
+void set_glyph_map(const lcd_char_map *map, byte amount){
+    glyph_map = map;
+    glyph_map_amount = amount;
+}
+
+byte glyph_char(byte id){
+
+    byte i, slot, in_use;
+
+    if (id >= glyph_amount && (id < GLYPH_HBAR_1 || id > GLYPH_VBAR_1 + BAR_V_STEPS - 2)) return NO_GLYPH;
+
+    for (slot = 0; slot < CGRAM_SLOTS; slot++){
+        if (lcd->cgram_glyph[slot] == id){
+            cgram_touch(slot);
+            return GLYPH_CHAR_BASE + slot;
+        }
+    }
+
+    // Slots whose char is on display, or about to be, cannot be evicted
+    in_use = lcd->cgram_pending;
+    for (i = 0; i < DDRAM_SIZE; i++)
+        if ((byte)lcd->ddram_shadow[i] < 2*CGRAM_SLOTS)
+            in_use |= 1 << (lcd->ddram_shadow[i] & (CGRAM_SLOTS - 1));
+
+    // Evict the least recently used of the others
+    for (i = CGRAM_SLOTS; i; i--)
+        if (!(in_use & (1 << lcd->cgram_lru[i - 1]))) break;
+    if (!i) return NO_GLYPH;
+
+    slot = lcd->cgram_lru[i - 1];
+    lcd->cgram_glyph[slot] = id;
+    lcd->cgram_pending |= 1 << slot;
+    cgram_touch(slot);
+
+    return GLYPH_CHAR_BASE + slot;
+
+}
+
+void write_glyph(byte id){
+
+    byte ch;
+
+    ch = glyph_char(id);
+    write_char(ch == NO_GLYPH ? '#' : ch);
+
+}
+
+void cgram_touch(byte slot){
+
+    byte i;
+
+    // Move slot to the front of the LRU list
+    for (i = 0; lcd->cgram_lru[i] != slot; i++);
+    for (; i; i--)
+        lcd->cgram_lru[i] = lcd->cgram_lru[i - 1];
+    lcd->cgram_lru[0] = slot;
+
+}
+
+void cgram_upload(void){
+
+    byte slot, row, next;
+
+    // All pending glyphs in one go, adjacent slots without a new CGRAM address
+    next = NO_GLYPH;
+    for (slot = 0; slot < CGRAM_SLOTS; slot++){
+
+        if (!(lcd->cgram_pending & (1 << slot))) continue;
+
+        if (slot != next) exec_instruction(SET_CGRAM_ADDRESS | (slot << 3));
+        for (row = 0; row < 8; row++)
+            send_char(glyph_row(lcd->cgram_glyph[slot], row));
+        next = slot + 1;
+
+    }
+
+    lcd->cgram_pending = 0;
+
+    // The address counter now points into CGRAM, next DDRAM access sets it again
+    lcd->ddram_address = ADDRESS_UNKNOWN;
+
+}
+
+byte glyph_row(byte id, byte row){
+
+    // Partial blocks are drawn rather than stored
+    if (id >= GLYPH_VBAR_1)
+        return row >= 8 - (id - GLYPH_VBAR_1 + 1) ? 0x1F : 0x00;
+    if (id >= GLYPH_HBAR_1)
+        return 0x1F & ~(0x1F >> (id - GLYPH_HBAR_1 + 1));
+
+    return pgm_read_byte(glyph_table + (unsigned int)id*8 + row);
+
+}
+
+void setup_bar(lcd_bar *bar, byte row, byte col, byte cells, byte vertical){
+
+    byte cell;
+
+    bar->row        = row;
+    bar->col        = col;
+    bar->cells      = cells;
+    bar->vertical   = vertical;
+    bar->value      = 0;
+
+    for (cell = 0; cell < cells; cell++)
+        shadow_put(bar_cell_address(bar, cell), ' ');
+    shadow_commit();
+
+}
+
+void set_bar(lcd_bar *bar, byte value){
+
+    byte steps, first, last, cell;
+
+    steps = bar->vertical ? BAR_V_STEPS : BAR_H_STEPS;
+    if (value > bar->cells*steps) value = bar->cells*steps;
+    if (value == bar->value) return;
+
+    // Only cells between the old and the new end of the bar change
+    first = (value < bar->value ? value : bar->value) / steps;
+    last = ((value > bar->value ? value : bar->value) - 1) / steps;
+
+    for (cell = first; cell <= last; cell++)
+        shadow_put(bar_cell_address(bar, cell), bar_cell_char(bar, cell, value));
+
+    bar->value = value;
+    shadow_commit();
+
+}
+
+byte bar_cell_address(lcd_bar *bar, byte cell){
+    if (bar->vertical) return canvas_address(bar->row - cell, bar->col);
+    return canvas_address(bar->row, bar->col + cell);
+}
+
+char bar_cell_char(lcd_bar *bar, byte cell, byte value){
+
+    byte steps, lit;
+
+    steps = bar->vertical ? BAR_V_STEPS : BAR_H_STEPS;
+    if (value <= cell*steps) return ' ';
+
+    lit = value - cell*steps;
+    if (lit >= steps) return (char)FULL_BLOCK_CHAR;
+
+    // A partial cell, falls back to a blank if no CGRAM slot is free
+    lit = glyph_char((bar->vertical ? GLYPH_VBAR_1 : GLYPH_HBAR_1) + lit - 1);
+    return lit == NO_GLYPH ? ' ' : (char)lit;
+
+}
+
+void setup_number(lcd_number *field, byte row, byte col, byte width, byte format){
+
+    byte i;
+
+    field->address  = canvas_address(row, col);
+    field->width    = width < NUMBER_MAX_WIDTH ? width : NUMBER_MAX_WIDTH;
+    field->format   = format;
+
+    // Cut at the end of the row
+    if (field->address == ADDRESS_UNKNOWN) field->width = 0;
+    else if (field->width > CANVAS_WIDTH - col) field->width = CANVAS_WIDTH - col;
+
+    for (i = 0; i < field->width; i++)
+        shadow_put(field->address + i, ' ');
+    shadow_commit();
+
+}
+
+void set_number(lcd_number *field, long value){
+
+    char digits[NUMBER_MAX_WIDTH];
+    byte i;
+
+    if (!number_digits(field, value, digits))
+        memset(digits, '#', field->width);
+
+    // The shadow drops the digits that are already on display
+    for (i = 0; i < field->width; i++)
+        shadow_put(field->address + i, digits[i]);
+    shadow_commit();
+
+}
+
+byte number_digits(lcd_number *field, long value, char digits[]){
+
+    unsigned long magnitude;
+    byte i, base, decimals, digit, done, negative, padding;
+
+    base = field->format & NUMBER_HEX ? 16 : 10;
+    decimals = field->format & NUMBER_DECIMALS_MASK;
+    negative = base == 10 && value < 0;
+    magnitude = negative ? 0UL - (unsigned long)value : (unsigned long)value;
+
+    // Right to left, down to the integer part's units digit at least
+    i = field->width;
+    done = 0;
+    for (;;){
+        if (!i) return FALSE;
+        if (decimals && done == decimals){
+            digits[--i] = '.';
+            decimals = 0;
+            continue;
+        }
+        digit = magnitude % base;
+        magnitude /= base;
+        digits[--i] = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        done++;
+        if (!magnitude && !decimals) break;
+    }
+
+    padding = field->format & NUMBER_ZERO_PAD ? '0' : ' ';
+    if (negative){
+        if (!i) return FALSE;
+        if (padding == '0') digits[0] = '-';
+        else digits[--i] = '-';
+    }
+    while (i > (negative && padding == '0'))
+        digits[--i] = padding;
+
+    return TRUE;
+
+}
+
+#ifdef LCD_POST
+byte lcd_post_text(const char *str, byte start_address, byte jump){
+
+    lcd_post_slot *slot;
+    byte position, len;
+
+    len = strlen(str);
+    if (len >= LCD_POST_TEXT_SIZE) return FALSE;
+
+    slot = post_reserve(POST_TEXT, &position);
+    if (!slot) return FALSE;
+
+    memcpy(slot->text, str, len + 1);
+    slot->arg = start_address;
+    slot->arg2 = jump;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_post_char(char ch){
+
+    lcd_post_slot *slot;
+    byte position;
+
+    slot = post_reserve(POST_CHAR, &position);
+    if (!slot) return FALSE;
+
+    slot->arg = ch;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_post_goto(byte address){
+
+    lcd_post_slot *slot;
+    byte position;
+
+    slot = post_reserve(POST_GOTO, &position);
+    if (!slot) return FALSE;
+
+    slot->arg = address;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_post_clear(void){
+
+    byte position;
+
+    if (!post_reserve(POST_CLEAR, &position)) return FALSE;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_post_number(lcd_number *field, long value){
+
+    lcd_post_slot *slot;
+    byte position;
+
+    slot = post_reserve(POST_NUMBER, &position);
+    if (!slot) return FALSE;
+
+    slot->object = field;
+    slot->value = value;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_post_bar(lcd_bar *bar, byte value){
+
+    lcd_post_slot *slot;
+    byte position;
+
+    slot = post_reserve(POST_BAR, &position);
+    if (!slot) return FALSE;
+
+    slot->object = bar;
+    slot->arg = value;
+    post_publish(position);
+
+    return TRUE;
+
+}
+
+byte lcd_process(void){
+
+    lcd_post_slot *slot;
+    byte lap, turn, ran;
+
+    // At most a queue's worth, producers can't keep lcd_process() from returning
+    for (ran = 0; ran < LCD_POST_QUEUE_SIZE; ran++){
+
+        slot = &post_slots[post_tail & POST_MASK];
+        lap = post_tail & ~POST_MASK;
+
+#ifdef LCD_BUS_CUSTOM
+        turn = atomic_load_explicit(&slot->turn, memory_order_acquire);
+#else
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            turn = slot->turn;
+#endif
+        // Not posted yet, or still being filled
+        if (turn != (byte)(lap + 1)) return ran;
+
+        if (slot->op == POST_TEXT)          write_text(slot->text, slot->arg, slot->arg2);
+        else if (slot->op == POST_CHAR)     write_char(slot->arg);
+        else if (slot->op == POST_GOTO)     gotoaddress(slot->arg);
+        else if (slot->op == POST_CLEAR)    clear_screen();
+        else if (slot->op == POST_NUMBER)   set_number(slot->object, slot->value);
+        else                                set_bar(slot->object, slot->arg);
+
+        // Free for the next lap
+#ifdef LCD_BUS_CUSTOM
+        atomic_store_explicit(&slot->turn, lap + LCD_POST_QUEUE_SIZE, memory_order_release);
+#else
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+            slot->turn = lap + LCD_POST_QUEUE_SIZE;
+#endif
+        post_tail++;
+
+    }
+
+    return ran;
+
+}
+
+lcd_post_slot *post_reserve(byte op, byte *position){
+
+    lcd_post_slot *slot;
+    byte pos;
+
+    // A slot is free for the position whose lap its turn holds, posted once it holds
+    // the lap plus one. Producers race for post_head, the winner owns the slot.
+#ifdef LCD_BUS_CUSTOM
+    signed char diff;
+
+    pos = atomic_load_explicit(&post_head, memory_order_relaxed);
+    for (;;){
+        slot = &post_slots[pos & POST_MASK];
+        diff = (signed char)(atomic_load_explicit(&slot->turn, memory_order_acquire) - (pos & ~POST_MASK));
+        if (diff < 0) return NULL;      // Still holds the previous lap's operation
+        if (!diff && atomic_compare_exchange_weak_explicit(&post_head, &pos, pos + 1,
+                                                           memory_order_relaxed, memory_order_relaxed))
+            break;
+        if (diff) pos = atomic_load_explicit(&post_head, memory_order_relaxed);
+    }
+#else
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+        pos = post_head;
+        slot = &post_slots[pos & POST_MASK];
+        if (slot->turn == (byte)(pos & ~POST_MASK)) post_head = pos + 1;
+        else slot = NULL;
+    }
+    if (!slot) return NULL;
+#endif
+
+    slot->op = op;
+    *position = pos;
+    return slot;
+
+}
+
+void post_publish(byte position){
+#ifdef LCD_BUS_CUSTOM
+    atomic_store_explicit(&post_slots[position & POST_MASK].turn, (position & ~POST_MASK) + 1, memory_order_release);
+#else
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        post_slots[position & POST_MASK].turn = (position & ~POST_MASK) + 1;
+#endif
+}
+#endif
@@ -20,9 +20,6 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 */
 
 #include <string.h>
-#define F_CPU 16000000
-#include <util/delay.h>
-#include <asf.h>
 
 #ifndef LCD4BITS_H_
 #define LCD4BITS_H_
@@ -30,34 +27,127 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 /************************************************************/
 /************** CUSTOMIZE HERE ******************************/
 
+/// Bus
+//#define LCD_BUS_CUSTOM                    // Uncomment to drive the LCD through an lcd_bus backend set with
+                                          // lcd_set_bus() (e.g. the host simulator in lcd_sim.h or the
+                                          // PCF8574 I2C backpack in lcd_pcf8574.h) instead of the port
+                                          // registers below
+/// Geometry
+#define LCD_COLS                 16       // Visible chars per row
+#define LCD_ROWS                 2        // Visible rows: 1, 2 or 4. Rows 3 and 4 continue rows 1 and 2
+                                          // in DDRAM, at L1_START+LCD_COLS and L2_START+LCD_COLS
 /// Data
+//#define LCD_8BIT                          // Uncomment if all 8 LCD data lines are connected. Each byte then
+                                          // takes a single enable pulse. RS, E and RW must be on other ports
 #define LCD_DATA_PORT            PORTC    // Select port where LCD data lines are connected
 #define LCD_DATA_PORT_CONFIG     DDRC
-#define LCD_DATA_PORT_LSB        0        // Select port bit where the first LCD data line is connected
+#define LCD_DATA_PORT_LSB        0        // Select port bit where the first LCD data line is connected (DB4,
+                                          // or DB0 with LCD_8BIT)
 /// Enable
 #define LCD_E_PORT               PORTC    // Select port where Enable line is connected
 #define LCD_E_PORT_CONFIG        DDRC
-#define LCD_E_BIT                4        // Select port bit where Enable line is connected
+#define LCD_E_BIT                4        // Select port bit where Enable line is connected. Further displays
+                                          // sharing data, RS and RW have their E line on other bits of
+                                          // LCD_E_PORT, see lcd_setup_display()
 /// RS
 #define LCD_RS_PORT              PORTC    // Select port where RS line is connected
 #define LCD_RS_PORT_CONFIG       DDRC
 #define LCD_RS_BIT               6        // Select port bit where RS line is connected
+#define LCD_RS_ON_DATA_PORT               // Comment out if RS line is not on LCD_DATA_PORT. If it is, RS and
+                                          // data are written with a single port store
+/// RW (optional)
+//#define LCD_USE_RW                        // Uncomment if RW line is connected. Busy flag will then be polled
+                                          // instead of waiting worst-case execution times
+#define LCD_RW_PORT              PORTC    // Select port where RW line is connected
+#define LCD_RW_PORT_CONFIG       DDRC
+#define LCD_RW_BIT               5        // Select port bit where RW line is connected
+#define LCD_DATA_PORT_INPUT      PINC     // Input register of the port where LCD data lines are connected
+
+
+
+#define TEXT_UNITS_AMT           4        // Select how many text units can be memorized by LCD module (15 at most)
+#define TEXT_ARENA_SIZE          60       // Select how many chars all text units memorized may add up to
 
+/// Execution times in us, as given by the datasheet for fosc = 270 kHz. They are only
+/// waited for when RW line is not used. Raise them for slow clones.
+#define LCD_EXEC_CLEAR_US        1520     // CMD_DISP_CLEAR
+#define LCD_EXEC_HOME_US         1520     // CMD_RET_HOME
+#define LCD_EXEC_ENTRY_US        37       // Entry mode set
+#define LCD_EXEC_CONTROL_US      37       // Display ON/OFF control (CMD_DISP_ON, CMD_DISP_OFF)
+#define LCD_EXEC_SHIFT_US        37       // CMD_CURSOR_*, CMD_DISP_LEFT, CMD_DISP_RIGHT
+#define LCD_EXEC_FUNCTION_US     37       // Function set
+#define LCD_EXEC_CGRAM_US        37       // Set CGRAM address
+#define LCD_EXEC_DDRAM_US        37       // SET_ADDRESS
+#define LCD_EXEC_WRITE_US        41       // Data write
+#define LCD_EXEC_SCALE           100      // Percentage applied to all of the above. For an oscillator
+                                          // running at f kHz, set to 100*270/f
 
+/// Asynchronous mode
+//#define LCD_ASYNC                         // Uncomment to queue transfers and have lcd_service() clock them out
+//#define LCD_ASYNC_ISR                     // Uncomment if lcd_service() is called from a timer ISR. Otherwise
+                                          // it is called whenever the driver has to wait for the queue
+#define LCD_QUEUE_SIZE           64       // Bytes that can be queued (power of 2, 256 at most)
+#define LCD_TICK_US              50       // Period in us at which lcd_service() is called
 
-#define TEXT_UNITS_AMT           2        // Select how many text units can be memorized by LCD module
-#define TEXT_UNIT_MAX_LEN        30       // Select a maximum length for the text units to be memorized
+/// Character set
+//#define LCD_UTF8                          // Uncomment to decode texts as UTF-8 and translate them to the codes
+                                          // of the character ROM. Chars it lacks take a glyph or show as "#"
+//#define LCD_ROM_A02                     // Uncomment if the controller has the European character ROM
+                                          // (A02) instead of the Japanese one (A00)
+/// Multiple producers
+//#define LCD_POST                          // Uncomment to let several tasks, threads or ISRs post whole
+                                          // operations, run one at a time by lcd_process()
+#define LCD_POST_QUEUE_SIZE      8        // Operations that can be waiting (power of 2, from 2 to 64)
+#define LCD_POST_TEXT_SIZE       (LCD_COLS+1)     // Longest text a posted write_text() carries, '\0' included
+
+/// Instrumentation
+//#define LCD_STATS                         // Uncomment to count bus traffic and blocking time in lcd_stats
+
+#define SHADOW_BRIDGE_GAP        2        // Unchanged cells between two changed ones that are rewritten
+                                          // instead of issuing a new SET_ADDRESS
 
 /************************************************************/
 /************************************************************/
 
+#if defined(LCD_8BIT) && defined(LCD_RS_ON_DATA_PORT) && !defined(LCD_BUS_CUSTOM)
+#error "LCD_8BIT takes the whole data port, RS must be on another port"
+#endif
+
+#ifndef LCD_BUS_CUSTOM
+#define F_CPU 16000000
+#include <util/delay.h>
+#include <util/atomic.h>
+#include <asf.h>
+#include <avr/pgmspace.h>
+#else
+// Flash and RAM share the address space on the host
+#define PROGMEM
+#define PSTR(s)                  (s)
+#define pgm_read_byte(p)         (*(const unsigned char *)(p))
+#define pgm_read_word(p)         (*(const unsigned int *)(p))
+#define strlen_P(s)              strlen(s)
+typedef const char *PGM_P;
+#ifdef LCD_POST
+#include <stdatomic.h>
+#endif
+#endif
+
 /// DEFINITIONS
 
-#define LCD_DATA_MASK            (0x0F << LCD_DATA_PORT_LSB)
+#ifdef LCD_8BIT
+#define LCD_DATA_BITS            0xFF     // Data lines, as seen by the LCD and by lcd_bus backends
+#define BUSY_FLAG_READ_BIT       0x80     // Busy flag (DB7) inside the byte read
+#else
+#define LCD_DATA_BITS            0x0F
+#define BUSY_FLAG_READ_BIT       0x08     // Busy flag (DB7) inside the first nibble read
+#endif
+#define LCD_DATA_MASK            ((byte)(LCD_DATA_BITS << LCD_DATA_PORT_LSB))  // Data lines on LCD_DATA_PORT
 #define LCD_E_MASK               (0x01 << LCD_E_BIT)
 #define LCD_RS_MASK              (0x01 << LCD_RS_BIT)
+#define LCD_RW_MASK              (0x01 << LCD_RW_BIT)
 
 #define SET_ADDRESS              0x80
+#define SET_CGRAM_ADDRESS        0x40
 #define CMD_DISP_RIGHT           0x1C
 #define CMD_DISP_LEFT            0x18
 #define CMD_CURSOR_RIGHT         0x14
@@ -66,20 +156,118 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 #define CMD_RET_HOME             0x02
 #define CMD_DISP_ON              0x0C
 #define CMD_DISP_OFF             0x08
+#define CMD_ENTRY_MODE           0x04
+#define FUNCTION_SET_8BIT        0x30
+#define FUNCTION_SET_4BIT        0x20
+#define FUNCTION_SET_2LINES      0x08
+#if LCD_ROWS > 1
+#define FUNCTION_SET_LINES       FUNCTION_SET_2LINES
+#else
+#define FUNCTION_SET_LINES       0x00
+#endif
+#ifdef LCD_8BIT
+#define FUNCTION_SET             (FUNCTION_SET_8BIT | FUNCTION_SET_LINES)
+#else
+#define FUNCTION_SET             (FUNCTION_SET_4BIT | FUNCTION_SET_LINES)
+#endif
+#define ENTRY_INCREMENT_BIT      0x02
+#define ENTRY_SHIFT_BIT          0x01
 #define CURSOR_BIT               0x02
 #define CURSORBLINK_BIT          0x01
 
 #define L1_START                 0x00
 #define L2_START                 0x40
+#define L3_START                 (L1_START + LCD_COLS)
+#define L4_START                 (L2_START + LCD_COLS)
 #define RIGHT                    0
 #define LEFT                     1
 #define JUMP                     1
+#define NO_MARQUEE               0xFF
+#define NO_UNIT                  0xFF     // Returned by register_text_unit() when it is out of room
+#define UNIT_MAX_LEN             255      // Bytes of a text unit, counted in a byte
+#define NO_GLYPH                 0xFF     // Returned by glyph_char() when every CGRAM slot is in use
+#define ADDRESS_UNKNOWN          0xFF     // LCD's address counter is not on a DDRAM address
+
+#define CGRAM_SLOTS              8
+#define GLYPH_HBAR_1             0xF0     // Built-in glyphs, left 1 to 4 columns lit, up to 0xF3
+#define GLYPH_VBAR_1             0xF4     // Built-in glyphs, bottom 1 to 7 rows lit, up to 0xFA
+#define BAR_H_STEPS              5        // Columns of a char cell
+#define BAR_V_STEPS              8        // Rows of a char cell
+#define FULL_BLOCK_CHAR          0xFF     // ROM char with every dot lit
+
+#define NUMBER_DEC               0x00
+#define NUMBER_HEX               0x20
+#define NUMBER_ZERO_PAD          0x10
+#define NUMBER_DECIMALS_MASK     0x0F     // Digits after the point, fixed-point decimal fields
+#define NUMBER_MAX_WIDTH         12       // Sign, 10 digits and point
+#define GLYPH_CHAR_BASE          0x08     // Chars 0x08 to 0x0F show CGRAM slots 0 to 7, like 0x00 to 0x07
+
+#define SCRUB_MODES              0        // Steps of a scrub pass: the modes, the display shift,
+#define SCRUB_SHIFT              1        // every DDRAM cell, then every row of every CGRAM slot
+#define SCRUB_CELLS              2
+#define SCRUB_GLYPHS             (SCRUB_CELLS+DDRAM_SIZE)
+#define SCRUB_STEPS              (SCRUB_GLYPHS+CGRAM_SLOTS*8)
+
+#define POST_TEXT                0        // Operations posted with lcd_post_*()
+#define POST_CHAR                1
+#define POST_GOTO                2
+#define POST_CLEAR               3
+#define POST_NUMBER              4
+#define POST_BAR                 5
+#define POST_MASK                (LCD_POST_QUEUE_SIZE - 1)
+
+#define EFFECT_NONE              0
+#define EFFECT_ROTATE            1
+#define EFFECT_BLINK             2
 
 #define TRUE                     0x01
 #define FALSE                    0x00
 
-#define ROW_LENGTH               40
-#define DISPLAY_WIDTH            16
+#define DDRAM_SIZE               80
+#if LCD_ROWS > 1
+#define ROW_LENGTH               (DDRAM_SIZE/2)   // Chars per DDRAM line, the period of display shift
+#else
+#define ROW_LENGTH               DDRAM_SIZE       // 1 line mode, DDRAM is a single 80 chars line
+#endif
+#define DISPLAY_WIDTH            LCD_COLS
+#if LCD_ROWS > 2
+#define CANVAS_WIDTH             LCD_COLS         // Rows 3 and 4 take the rest of the DDRAM lines
+#else
+#define CANVAS_WIDTH             ROW_LENGTH       // Chars per row that the viewport can be panned over
+#endif
+
+#if TEXT_UNITS_AMT > 15
+#error "TEXT_UNITS_AMT must fit in the low nibble of a tag"
+#endif
+#if TEXT_ARENA_SIZE > UNIT_MAX_LEN
+#error "TEXT_ARENA_SIZE must fit in a byte"
+#endif
+#if defined(LCD_POST) && (LCD_POST_QUEUE_SIZE < 2 || LCD_POST_QUEUE_SIZE > 64 || (LCD_POST_QUEUE_SIZE & POST_MASK))
+#error "LCD_POST_QUEUE_SIZE must be a power of 2, from 2 to 64"
+#endif
+#if LCD_EXEC_HOME_US*LCD_EXEC_SCALE/100 <= 1000 || LCD_EXEC_CLEAR_US*LCD_EXEC_SCALE/100 <= 1000
+#error "Clear and return home take over 1 ms on every HD44780, check LCD_EXEC_*_US and LCD_EXEC_SCALE"
+#endif
+#if defined(LCD_ASYNC) && \
+    (LCD_EXEC_CLEAR_US > LCD_EXEC_HOME_US ? LCD_EXEC_CLEAR_US : LCD_EXEC_HOME_US)*LCD_EXEC_SCALE/100 > 256*LCD_TICK_US
+#error "Clear and return home must last 256 LCD_TICK_US at most, the ticks left are counted in a byte"
+#endif
+#if LCD_ROWS != 1 && LCD_ROWS != 2 && LCD_ROWS != 4
+#error "LCD_ROWS must be 1, 2 or 4"
+#endif
+#if LCD_COLS*(LCD_ROWS > 2 ? 2 : 1) > ROW_LENGTH
+#error "LCD_COLS does not fit in a DDRAM line"
+#endif
+
+// Instruction classes, given by the highest bit set in the instruction
+#define INST_CLASS_CLEAR         0
+#define INST_CLASS_HOME          1
+#define INST_CLASS_ENTRY         2
+#define INST_CLASS_CONTROL       3
+#define INST_CLASS_SHIFT         4
+#define INST_CLASS_FUNCTION      5
+#define INST_CLASS_CGRAM         6
+#define INST_CLASS_DDRAM         7
 
 
 /// TYPE DEFINITIONS
@@ -87,30 +275,257 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
 typedef unsigned char byte;
 typedef struct {
     byte start_address;
-    byte size;
+    byte size;                              // Chars, as shown
+    byte length;                            // Bytes, more than size if UTF-8 chars take several
     byte window_size;
     byte jump;
     byte offset;
+    byte marquee;
+    byte arena_start;                       // Where the unit's chars start in the arena
+    PGM_P flash_text;                       // The unit's chars in flash instead, or 0
+    byte generation;                        // High nibble of the unit's tag, bumped when unregistered
 } unit_tag;
 typedef unit_tag unit_tags[TEXT_UNITS_AMT];
-typedef char text_units[TEXT_UNITS_AMT][TEXT_UNIT_MAX_LEN];
+typedef struct {
+    byte type;                              // EFFECT_NONE, EFFECT_ROTATE or EFFECT_BLINK
+    byte direction;
+    byte stride;
+    byte shown;                             // Blink phase
+    unsigned int period;
+    unsigned int on_time;
+    unsigned int due;                       // Time of next step
+} unit_effect;
+typedef unit_effect unit_effects[TEXT_UNITS_AMT];
+typedef struct {
+    char            arena[TEXT_ARENA_SIZE];     // Chars of every text unit, each at its actual length
+    byte            arena_used;
+    unit_tags       tags;                       // A unit is free when its size is 0
+    unit_effects    effects;
+    char            ddram_shadow[DDRAM_SIZE];   // What the LCD's DDRAM currently holds
+    byte            ddram_dirty[DDRAM_SIZE/8];  // Cells of ddram_shadow not yet sent to the LCD
+    byte            ddram_address;              // LCD's address counter
+    byte            cursor_address;             // Address where write_char() will write next
+    byte            display_control;            // Last display ON/OFF control instruction
+    byte            entry_mode;                 // Last entry mode set instruction
+    byte            display_shift;              // Times the display has been shifted left, modulo ROW_LENGTH
+    byte            marquee_tag;                // Text unit currently scrolled by display shifts
+    byte            frame_mode;                 // Changes stay in ddram_shadow until lcd_tick()
+    unsigned int    frame_budget_us;            // Bus time lcd_tick() may use, 0 for no limit
+    byte            flush_start;                // Where a flush cut short by its budget stopped
+    unsigned int    scrub_budget_us;            // Bus time lcd_scrub() may use, 0 for a whole pass
+    byte            scrub_step;                 // What lcd_scrub() refreshes next, see SCRUB_*
+    byte            cgram_glyph[CGRAM_SLOTS];   // Glyph held by each CGRAM slot, NO_GLYPH if none
+    byte            cgram_lru[CGRAM_SLOTS];     // CGRAM slots, most recently used first
+    byte            cgram_pending;              // CGRAM slots to upload on the next flush, one bit each
+    byte            e_mask;                     // E line of this display's controller
+#ifndef LCD_USE_RW
+    unsigned int    ready_at;                   // Value of lcd_clock_us at which the LCD is done executing
+#endif
+} lcd_display;
+typedef struct {
+    byte            row;                        // Row and column of the bar's first cell, the
+    byte            col;                        // leftmost one, or the bottom one if vertical
+    byte            cells;
+    byte            vertical;
+    byte            value;                      // Columns, or rows, lit
+} lcd_bar;
+typedef struct {
+    byte            address;                    // Leftmost char of the field
+    byte            width;
+    byte            format;
+} lcd_number;
+typedef struct {
+    unsigned int    code_point;                 // Unicode, tables sorted by it
+    byte            code;                       // ROM char, or glyph ID
+} lcd_char_map;
+#ifdef LCD_POST
+typedef struct {
+#ifdef LCD_BUS_CUSTOM
+    atomic_uchar    turn;                       // Lap of the queue the slot is free, or posted, for
+#else
+    volatile byte   turn;
+#endif
+    byte            op;                         // POST_*
+    byte            arg;
+    byte            arg2;
+    void            *object;                    // lcd_number or lcd_bar
+    long            value;
+    char            text[LCD_POST_TEXT_SIZE];
+} lcd_post_slot;
+#endif
+#ifdef LCD_BUS_CUSTOM
+typedef struct {
+    void (*set_data)(byte data);            // Drive DB4..DB7, or DB0..DB7 with LCD_8BIT
+    void (*set_en)(byte mask, byte level);  // Drive the E lines set in "mask"
+    void (*set_rs)(byte level);
+    void (*set_rw)(byte level);
+    void (*data_dir)(byte input);           // Set to 1 to release the data lines so the LCD can drive them
+    byte (*get_data)(void);                 // Read the data lines
+    void (*delay_us)(unsigned long us);
+    void (*flush)(void);                    // Send what the backend has buffered, NULL if it doesn't buffer
+} lcd_bus;
+#endif
+
+
+#ifdef LCD_STATS
+typedef struct {
+    unsigned long nibbles;                  // Enable pulses, 4 bit transfers in either direction
+    unsigned long bytes;                    // Instructions and chars sent
+    unsigned long chars;                    // Chars sent
+    unsigned long instructions[8];          // Instructions sent, by class (see INST_CLASS_*)
+    unsigned long blocked_us;               // Time spent in delays
+} lcd_stats;
+#endif
 
 
 /// MACROS
 
-#define _set_data(data)       LCD_DATA_PORT = ( LCD_DATA_PORT & ~LCD_DATA_MASK ) | ( (data << LCD_DATA_PORT_LSB) & LCD_DATA_MASK )
-#define _set_EN_to_1()        LCD_E_PORT = LCD_E_PORT | LCD_E_MASK
-#define _set_EN_to_0()        LCD_E_PORT = LCD_E_PORT & ~LCD_E_MASK
+#ifndef LCD_BUS_CUSTOM
+#define _set_data(data)       LCD_DATA_PORT = ( LCD_DATA_PORT & (byte)~LCD_DATA_MASK ) | ( (data << LCD_DATA_PORT_LSB) & LCD_DATA_MASK )
+#define _set_EN_to_1(mask)    LCD_E_PORT = LCD_E_PORT | (mask)
+#define _set_EN_to_0(mask)    LCD_E_PORT = LCD_E_PORT & ~(mask)
 #define _set_RS_to_1()        LCD_RS_PORT = LCD_RS_PORT | LCD_RS_MASK
 #define _set_RS_to_0()        LCD_RS_PORT = LCD_RS_PORT & ~LCD_RS_MASK
+#define _set_RW_to_1()        LCD_RW_PORT = LCD_RW_PORT | LCD_RW_MASK
+#define _set_RW_to_0()        LCD_RW_PORT = LCD_RW_PORT & ~LCD_RW_MASK
+#define _get_data()           ( (LCD_DATA_PORT_INPUT & LCD_DATA_MASK) >> LCD_DATA_PORT_LSB )
+#define _data_as_input()      LCD_DATA_PORT_CONFIG = LCD_DATA_PORT_CONFIG & (byte)~LCD_DATA_MASK
+#define _data_as_output()     LCD_DATA_PORT_CONFIG = LCD_DATA_PORT_CONFIG | LCD_DATA_MASK
+#define _bus_flush()
+#ifdef LCD_RS_ON_DATA_PORT
+#define _set_data_RS(data, rs) LCD_DATA_PORT = ( LCD_DATA_PORT & (byte)~(LCD_DATA_MASK | LCD_RS_MASK) ) | \
+                                ( (data << LCD_DATA_PORT_LSB) & LCD_DATA_MASK ) | ( (rs) ? LCD_RS_MASK : 0 )
+#endif
+#else
+#define _set_data(data)       lcd_bus_backend->set_data((data) & LCD_DATA_BITS)
+#define _set_EN_to_1(mask)    lcd_bus_backend->set_en((mask), 1)
+#define _set_EN_to_0(mask)    lcd_bus_backend->set_en((mask), 0)
+#define _set_RS_to_1()        lcd_bus_backend->set_rs(1)
+#define _set_RS_to_0()        lcd_bus_backend->set_rs(0)
+#define _set_RW_to_1()        lcd_bus_backend->set_rw(1)
+#define _set_RW_to_0()        lcd_bus_backend->set_rw(0)
+#define _get_data()           lcd_bus_backend->get_data()
+#define _data_as_input()      lcd_bus_backend->data_dir(1)
+#define _data_as_output()     lcd_bus_backend->data_dir(0)
+#define _delay_us(us)         lcd_bus_backend->delay_us(us)
+#define _delay_ms(ms)         lcd_bus_backend->delay_us((ms)*1000UL)
+#define _bus_flush()          ( lcd_bus_backend->flush ? lcd_bus_backend->flush() : (void)0 )
+#endif
+#ifndef _set_data_RS
+#define _set_data_RS(data, rs) ( (rs) ? (_set_RS_to_1()) : (_set_RS_to_0()), _set_data(data) )
+#endif
+#ifdef LCD_8BIT
+#define _set_data_high(data)  _set_data(data)
+#else
+#define _set_data_high(data)  _set_data((data) >> 4)    // Only DB4..DB7 are wired
+#endif
+
+#if defined(LCD_STATS) && defined(LCD_ASYNC_ISR) && !defined(LCD_BUS_CUSTOM)
+// lcd_service() counts from its ISR too, so updates from main context must not be torn
+#define _stat_inc(field)      stat_add(&lcd_stats_counters.field, 1)
+#define _stat_add(field, n)   stat_add(&lcd_stats_counters.field, (n))
+#elif defined(LCD_STATS)
+#define _stat_inc(field)      lcd_stats_counters.field++
+#define _stat_add(field, n)   lcd_stats_counters.field += (n)
+#else
+#define _stat_inc(field)      ((void)0)
+#define _stat_add(field, n)   ((void)0)
+#endif
+#ifndef LCD_USE_RW
+#define _clock_add(us)        lcd_clock_us += (us)
+#else
+#define _clock_add(us)        ((void)0)
+#endif
+#define _lcd_delay_us(us)     ( _stat_add(blocked_us, (us)), _clock_add(us), _delay_us(us) )
+#define _lcd_delay_ms(ms)     ( _stat_add(blocked_us, (ms)*1000UL), _clock_add((ms)*1000U), _delay_ms(ms) )
+
+#if LCD_ROWS > 1
+#define _ddram_index(addr)    ( (addr) >= L2_START ? (addr) - L2_START + ROW_LENGTH : (addr) - L1_START )
+#define _ddram_address(idx)   ( (idx) >= ROW_LENGTH ? (idx) - ROW_LENGTH + L2_START : (idx) + L1_START )
+#else
+#define _ddram_index(addr)    ( (addr) - L1_START )
+#define _ddram_address(idx)   ( (idx) + L1_START )
+#endif
+#define _ddram_line(addr)     ( _ddram_index(addr) / ROW_LENGTH * ROW_LENGTH )  // Index of the line's 1st cell
+#if LCD_ROWS > 1
+#define _valid_address(addr)  ( (byte)((addr) - L1_START) < ROW_LENGTH || (byte)((addr) - L2_START) < ROW_LENGTH )
+#else
+#define _valid_address(addr)  ( (byte)((addr) - L1_START) < DDRAM_SIZE )
+#endif
+#define _unit_handle(slot)    ( (lcd->tags[slot].generation << 4) | (slot) )
+#define _unit_char(slot, i)   ( lcd->tags[slot].flash_text ? (char)pgm_read_byte(lcd->tags[slot].flash_text + (i)) : \
+                                lcd->arena[lcd->tags[slot].arena_start + (i)] )
+
+#ifdef LCD_UTF8
+#define _put_text_char(ch)    put_utf8(ch)
+#define _utf8_continuation(ch) ( ((byte)(ch) & 0xC0) == 0x80 )
+// A unit's chars are walked by the byte each starts at, see unit_char_pos()
+#define _text_chars(str, len, flash)  utf8_chars(str, len, flash)
+#define _unit_char_pos(slot, index)   unit_char_pos(slot, index)
+#define _unit_next(slot, pos)         unit_next(slot, pos)
+#define _unit_rom_char(slot, pos)     unit_rom_char(slot, pos)
+#else
+#define _put_text_char(ch)    put_char(ch)
+#define _text_chars(str, len, flash)  (len)
+#define _unit_char_pos(slot, index)   (index)
+#define _unit_next(slot, pos)         ( ((pos) + 1) % lcd->tags[slot].size )
+#define _unit_rom_char(slot, pos)     _unit_char(slot, pos)
+#endif
+#define _next_address(addr)   _ddram_address( (_ddram_index(addr) + 1) % DDRAM_SIZE )
+#define _prev_address(addr)   _ddram_address( (_ddram_index(addr) + DDRAM_SIZE - 1) % DDRAM_SIZE )
+
+#define _ini_wait1()          _lcd_delay_ms(20)   // Wait fore more than 15 ms
+#define _ini_wait2()          _lcd_delay_ms(5)    // Wait for more than 4.1 ms
+#define _ini_wait3()          _lcd_delay_us(500)  // Wait for more than 100 us
+#define _warm_wait()          _lcd_delay_us(_exec_scaled(LCD_EXEC_FUNCTION_US))  // Whole, lcd_service() may follow
+#ifdef LCD_USE_RW
+#define ENA_WAIT1_US          1               // Enable pulse width, data setup/delay times
+#define ENA_WAIT2_US          1               // Rest of enable cycle time
+#define _wait_ready()         wait_busy()
+#else
+#define ENA_WAIT1_US          30
+#define ENA_WAIT2_US          15
+#define _wait_ready()         wait_ready()
+#endif
+#define _ena_wait1()          _lcd_delay_us(ENA_WAIT1_US)
+#define _ena_wait2()          _lcd_delay_us(ENA_WAIT2_US)
 
-#define _ini_wait1()          _delay_ms(20)   // Wait fore more than 15 ms
-#define _ini_wait2()          _delay_ms(5)    // Wait for more than 4.1 ms
-#define _ini_wait3()          _delay_us(500)  // Wait for more than 100 us
-#define _ini_wait4()          _delay_ms(50)
-#define _exec_wait()          _delay_ms(2)
-#define _ena_wait1()          _delay_us(30)
-#define _ena_wait2()          _delay_us(15)
+// The next transfer is latched on the falling edge of its first enable pulse, so a whole
+// enable cycle of the execution time has already gone by when it reaches the LCD
+// Scaled in unsigned long, 1520*100 overflows a 16 bit int
+#define _exec_scaled(us)      ( (us)*(unsigned long)LCD_EXEC_SCALE/100 )
+#define _exec_time(us)        ( _exec_scaled(us) > ENA_WAIT1_US+ENA_WAIT2_US ? \
+                                _exec_scaled(us) - (ENA_WAIT1_US+ENA_WAIT2_US) : 0 )
+// Waits are lazy: the LCD is only waited for before the next transfer to it, so that
+// other displays on the bus can be served meanwhile
+#define _exec_wait(us)        lcd->ready_at = lcd_clock_us + _exec_time(us)
+#define READY_STEP_US         8               // Delay step used while waiting for an LCD
+#define LONGEST_EXEC_US       _exec_time(LCD_EXEC_CLEAR_US > LCD_EXEC_HOME_US ? LCD_EXEC_CLEAR_US : LCD_EXEC_HOME_US)
+
+// Estimated bus time of a char write and of a SET_ADDRESS
+#define CHAR_COST_US          ( 2*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_WRITE_US) )
+#define ADDRESS_COST_US       ( 2*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_DDRAM_US) )
+#define SHIFT_COST_US         ( 2*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_SHIFT_US) )
+#define HOME_COST_US          ( 2*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_HOME_US) )
+// and of a DDRAM read, and of function set, display control and entry mode together
+#define READ_COST_US          ( 2*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_WRITE_US) )
+#define MODES_COST_US         ( 6*(ENA_WAIT1_US+ENA_WAIT2_US) + _exec_time(LCD_EXEC_FUNCTION_US) + \
+                                _exec_time(LCD_EXEC_CONTROL_US) + _exec_time(LCD_EXEC_ENTRY_US) )
+
+// Ticks skipped by lcd_service() after a transfer, the next one being sent on the tick that follows
+#define _exec_ticks(us)       ( _exec_scaled(us) > LCD_TICK_US ? \
+                                (_exec_scaled(us) + LCD_TICK_US - 1)/LCD_TICK_US - 1 : 0 )
+#ifdef LCD_ASYNC
+#define _exec_class(us)       _exec_ticks(us)
+#else
+#define _exec_class(us)       _exec_time(us)
+#endif
+#define _ena_pulse(mask)      _set_EN_to_1(mask); _lcd_delay_us(1); _set_EN_to_0(mask); _stat_inc(nibbles)
+#ifdef LCD_ASYNC_ISR
+#define _service_tick()
+#else
+#define _service_tick()       { lcd_service(); _lcd_delay_us(LCD_TICK_US); }
+#endif
 
 
 /// PROTOTYPES
@@ -130,22 +545,85 @@ void initialize_lcd(byte cursor_on, byte blink_on);
  *****************************************************************************/
 void reset_lcd(byte cursor_on, byte blink_on);
 
+/******************************************************************************
+ * Summary:         Re-initializes an LCD that kept its power, e.g. after a glitch
+ *                  on the bus or a brown-out that did not reset the controller.
+ *                  Function set, display control and entry mode are sent again,
+ *                  as last set, without the power-on waits of reset_lcd(). The
+ *                  display shift is then set again from a return home, so panned
+ *                  views and marquees stay where they were. DDRAM and CGRAM
+ *                  contents are left as they are.
+ *****************************************************************************/
+void warm_reset_lcd(void);
+
 /******************************************************************************
  * Summary:            Clears all data on screen.
  *****************************************************************************/
 void clear_screen(void);
 
 /******************************************************************************
- * Summary:         Sets parameter "address" into LCD's address counter.
+ * Summary:         Sets parameter "address" into LCD's address counter. The
+ *                  instruction is only sent when the cursor is visible; otherwise
+ *                  "address" is remembered and set when it is first written to.
  *
  * Input:           byte address     :    Parameter address is a permitted DDRAM address.
  *                                        To place the cursor on the first position of either the
  *                                        first or the second line, set parameter to defined values
  *                                        L1_START or L2_START respectively. Choose concrete positions
  *                                        in either line by adding an offset, as in L1_START+offset.
+ *                                        Addresses outside DDRAM are ignored.
  *****************************************************************************/
 void gotoaddress(byte address);
 
+/******************************************************************************
+ * Summary:         Returns the DDRAM address shown at row "row", column "col"
+ *                  of the viewport, for the configured geometry and the current
+ *                  display shift.
+ *
+ * Input:           byte row     :    0 to LCD_ROWS-1, ADDRESS_UNKNOWN is returned otherwise.
+ *                  byte col     :    0 to LCD_COLS-1.
+ *****************************************************************************/
+byte row_col_address(byte row, byte col);
+
+/******************************************************************************
+ * Summary:         Same as gotoaddress(row_col_address(row, col)).
+ *****************************************************************************/
+void gotorowcol(byte row, byte col);
+
+/******************************************************************************
+ * Summary:         The canvas is the whole DDRAM line behind each row, of which
+ *                  the viewport shows LCD_COLS chars. Pages composed off screen
+ *                  (e.g. in frame mode, while the display is idle) are brought
+ *                  into view with pan_to(), which shifts the display instead of
+ *                  rewriting it. On 4 row panels rows 3 and 4 already take the
+ *                  rest of the lines, so the canvas is as wide as the panel.
+ *
+ *                  canvas_address() returns the DDRAM address of a canvas cell,
+ *                  whatever the viewport shows, or ADDRESS_UNKNOWN outside the
+ *                  canvas. Cells of bars and numeric fields outside it are not
+ *                  shown.
+ *
+ * Input:           byte row     :    0 to LCD_ROWS-1.
+ *                  byte col     :    0 to CANVAS_WIDTH-1.
+ *****************************************************************************/
+byte canvas_address(byte row, byte col);
+
+/******************************************************************************
+ * Summary:         Writes str[] on the canvas from (row, col), cut at the end of
+ *                  the row, and leaves the cursor after it.
+ *****************************************************************************/
+void write_canvas(char str[], byte row, byte col);
+
+/******************************************************************************
+ * Summary:         Shows the canvas from column "col" on, with display shifts or,
+ *                  back to column 0, a return home when that is shorter.
+ *                  pan_position() returns the column at the viewport's left edge.
+ *
+ * Input:           byte col     :    0 to CANVAS_WIDTH-1, e.g. page*LCD_COLS.
+ *****************************************************************************/
+void pan_to(byte col);
+byte pan_position(void);
+
 /******************************************************************************
  * Summary:         Returns both display and cursor to the original position (address 0).
  *****************************************************************************/
@@ -160,7 +638,8 @@ void gohome(void);
 void switch_display(byte on);
 
 /******************************************************************************
- * Summary:         Cursor is moved right or left.
+ * Summary:         Cursor is moved right or left. A single SET_ADDRESS is used
+ *                  whatever the value of "times", as with gotoaddress().
  *
  * Input:           byte times    :   The cursor will be moved right or left a
  *                                    maximum of 255 times.
@@ -187,47 +666,189 @@ void move_screen_right(byte times);
 void erase_line(byte start_address);
 
 /******************************************************************************
- * Summary:         This function will write str[] on display. Unrecognized
- *                  chars will be shown as "#".
+ * Summary:         This function will write str[] on display. With LCD_UTF8,
+ *                  str[] is decoded as it is written and chars missing from the
+ *                  ROM are shown as a glyph (see set_glyph_map()) or as "#".
+ *                  Bytes below 0x20, e.g. glyph_char()s, are written as they are.
+ *                  Text is first written into
+ *                  the driver's DDRAM mirror and only those chars that differ
+ *                  from what the display already shows are sent to the LCD.
  *
  * Input:           char str[]            :    Array of chars to be written on display.
  *                  byte start_address    :    Address of str[0].
  *                  byte jump             :    If jump == 1 and length of str[] is greater than
- *                                             display width, str[] will continue on row 2 if
- *                                             "start_address" was on row 1, and vice versa. Also,
- *                                             if jump == 1, only SCREENWIDTH*2 chars will be
+ *                                             display width, every DISPLAY_WIDTH chars str[] will
+ *                                             continue on the next row, at the same column, and
+ *                                             on the first row after the last one. Also, if
+ *                                             jump == 1, only DISPLAY_WIDTH*LCD_ROWS chars will be
  *                                             written.
  *****************************************************************************/
 void write_text(char str[], byte start_address, byte jump);
 
+/******************************************************************************
+ * Summary:         Same as write_text(), with str[] in flash, e.g. PSTR("Temp:").
+ *                  Chars are read one by one as they are written, str[] is
+ *                  never copied to RAM.
+ *****************************************************************************/
+void write_text_P(PGM_P str, byte start_address, byte jump);
+
 /******************************************************************************
  * Summary:         Writes a char at the position indicated by the current address.
+ *                  Nothing is sent to the LCD if the display already shows "ch" there.
  *
  * Input:           ch                   :    The char to be written.
  *****************************************************************************/
 void write_char(char ch);
 
 /******************************************************************************
- * Summary:          This function will register str[] as a logical text unit in the "units" array.
- *                   A numerical value will be returned containing the newly created logical text unit's tag.
- *                   This tag can be used in other functions to apply changes to the logical text
- *                   unit identified by it.
+ * Summary:         Sets the bitmaps of the custom glyphs, e.g.
+ *
+ *                      const byte glyphs[][8] PROGMEM = {
+ *                          {0x04, 0x0E, 0x0E, 0x0E, 0x1F, 0x00, 0x04, 0x00},    // Bell
+ *                          ...
+ *                      };
+ *                      set_glyph_table(&glyphs[0][0], sizeof(glyphs)/8);
+ *
+ *                  Glyph IDs are their indexes in the table. Any number of them
+ *                  can be used; the 8 most recently used are kept in CGRAM.
+ *
+ * Input:           const byte *table    :    8 rows of 5 bits per glyph, in flash.
+ *                  byte amount          :    Glyphs in table.
+ *****************************************************************************/
+void set_glyph_table(const byte *table, byte amount);
+
+/******************************************************************************
+ * Summary:         With LCD_UTF8, sets the glyphs standing in for chars that the
+ *                  character ROM lacks, e.g.
+ *
+ *                      const lcd_char_map bell[] PROGMEM = {{0x237E, 0}};
+ *                      set_glyph_map(bell, 1);
+ *
+ * Input:           const lcd_char_map *map :   Code points and glyph IDs, in flash.
+ *                  byte amount          :    Entries in map.
+ *****************************************************************************/
+void set_glyph_map(const lcd_char_map *map, byte amount);
+
+/******************************************************************************
+ * Summary:         Returns the char that shows glyph "id", loading it into a
+ *                  CGRAM slot first if it is not there. The slot taken is the
+ *                  least recently used one whose char is not on display. The
+ *                  upload is sent along with the next changes to the display,
+ *                  before them, without moving the cursor.
+ *
+ * Input:           byte id              :    Index of the glyph in the glyph table, or one of
+ *                                            the built-in bar glyphs, GLYPH_HBAR_1+n and
+ *                                            GLYPH_VBAR_1+n.
+ * Output:          byte ch              :    Char to write, from GLYPH_CHAR_BASE on so that
+ *                                            it can be part of a string, or NO_GLYPH if
+ *                                            all 8 glyphs in CGRAM are on display.
+ *****************************************************************************/
+byte glyph_char(byte id);
+
+/******************************************************************************
+ * Summary:         Same as write_char(glyph_char(id)). A "#" is written if no
+ *                  CGRAM slot is available.
+ *****************************************************************************/
+void write_glyph(byte id);
+
+/******************************************************************************
+ * Summary:         Binds "bar" to a segment of the display and blanks it. The
+ *                  bar is drawn with full blocks and one partial block glyph
+ *                  from the CGRAM cache, so a 16 cells bar has 80 steps.
+ *
+ * Input:           lcd_bar *bar         :    Storage for the bar's state.
+ *                  byte row, col        :    Position of the leftmost cell, or of the
+ *                                            bottom cell if vertical.
+ *                  byte cells           :    Length of the bar, in cells. Vertical bars
+ *                                            grow upwards, on rows row-cells+1 to row.
+ *                  byte vertical        :    Set to 1 for a vertical bar.
+ *****************************************************************************/
+void setup_bar(lcd_bar *bar, byte row, byte col, byte cells, byte vertical);
+
+/******************************************************************************
+ * Summary:         Sets the length of "bar". Only the cells between its previous
+ *                  and its new end are rewritten, usually one or two.
+ *
+ * Input:           lcd_bar *bar         :    A bar bound with setup_bar().
+ *                  byte value           :    Dot columns lit, 0 to cells*BAR_H_STEPS, or
+ *                                            dot rows lit for a vertical bar, 0 to
+ *                                            cells*BAR_V_STEPS.
+ *****************************************************************************/
+void set_bar(lcd_bar *bar, byte value);
+
+/******************************************************************************
+ * Summary:         Binds "field" to "width" chars of a row and blanks them. The
+ *                  field is cut at the end of the canvas row.
+ *
+ * Input:           lcd_number *field    :    Storage for the field's state.
+ *                  byte row, col        :    Position of the leftmost char.
+ *                  byte width           :    Up to NUMBER_MAX_WIDTH chars. Numbers are
+ *                                            right aligned.
+ *                  byte format          :    NUMBER_DEC or NUMBER_HEX, optionally ORed
+ *                                            with NUMBER_ZERO_PAD and, for fixed-point
+ *                                            values, the amount of decimals, e.g.
+ *                                            NUMBER_DEC | 1 shows 215 as "21.5".
+ *****************************************************************************/
+void setup_number(lcd_number *field, byte row, byte col, byte width, byte format);
+
+/******************************************************************************
+ * Summary:         Shows "value" in "field", without printf. The digits that did
+ *                  not change are not sent, so going from 1234 to 1235 costs a
+ *                  single char write. A value that does not fit fills the field
+ *                  with '#'.
+ *
+ * Input:           lcd_number *field    :    A field bound with setup_number().
+ *                  long value           :    Negative values are only shown as such by
+ *                                            decimal fields. Hex fields show the two's
+ *                                            complement.
+ *****************************************************************************/
+void set_number(lcd_number *field, long value);
+
+/******************************************************************************
+ * Summary:          This function will register str[] as a logical text unit. str[] is copied to
+ *                   the text unit arena, taking as many bytes as its length. With LCD_UTF8 it is
+ *                   decoded as in write_text(), and window sizes, offsets and rotations count
+ *                   chars rather than bytes. A numerical value will
+ *                   be returned containing the newly created logical text unit's tag. This tag can
+ *                   be used in other functions to apply changes to the logical text unit identified
+ *                   by it.
  *
  * Input:            char str[]          :    Array of chars to be written on display.
  *                   byte window_size    :    Size of the character window inside of which str[] will
  *                                            be shown. Set to 0 in order to equate the size of the
  *                                            window to the length of str[]. If window_size > 0, then
  *                                            only window_size chars of str[] will be displayed.
- *                   byte jump           :    If jump == 1 and length of str[] is greater than
- *                                            DISPLAY_WIDTH, str[] will continue on row 2 if
- *                                            "start_address" was on row 1, and vice versa. Also,
- *                                            if jump == 1, only SCREENWIDTH*2 chars will be
- *                                            written.
- * Output:           byte tag            :    This tag is the index of the newly created logical text unit's
- *                                            position inside the array of tags "units".
+ *                   byte jump           :    As in write_text().
+ * Output:           byte tag            :    The newly created logical text unit's tag, or NO_UNIT if
+ *                                            str[] is empty, TEXT_UNITS_AMT units are registered or
+ *                                            the arena has no room left for str[]. A tag holds the
+ *                                            unit's slot in its low nibble and a generation count in
+ *                                            its high nibble, so tags of unregistered units are
+ *                                            ignored by every function, even once their slot is reused.
  *****************************************************************************/
 byte register_text_unit(char str[], byte window_size, byte jump);
 
+/******************************************************************************
+ * Summary:          Same as register_text_unit(), with str[] in flash. The unit's chars are
+ *                   read from flash whenever it is shown and take no room in the arena.
+ *                   str[] must stay in place while the unit is registered, and be
+ *                   UNIT_MAX_LEN bytes long at most, e.g.
+ *
+ *                       const char label[] PROGMEM = "Pressure";
+ *                       tag = register_text_unit_P(label, 0, 0);
+ *****************************************************************************/
+byte register_text_unit_P(PGM_P str, byte window_size, byte jump);
+
+/******************************************************************************
+ * Summary:          Frees the logical text unit identified by "tag", its slot and its space
+ *                   in the arena. What it shows is left on display, call
+ *                   toggle_text_unit(tag, 0) first to erase it. Arena space is compacted
+ *                   when a later register_text_unit() needs it.
+ *
+ * Input:            byte tag            :    Identifies a logical text unit.
+ *****************************************************************************/
+void unregister_text_unit(byte tag);
+
 /******************************************************************************
  * Summary:         This function will show the text identified by "tag" starting on "start_address".
  *
@@ -281,4 +902,220 @@ void return_text_unit_to_initial_position(byte tag);
  *****************************************************************************/
 void replace_chars_in_text_unit(byte tag, byte *offsets, char *chars, byte num_offsets);
 
+/******************************************************************************
+ * Summary:           Enables or disables marquee mode for the logical text unit identified
+ *                    by "tag". While a marquee unit is the only thing shown on the display
+ *                    (the rest of its row and the other row are blank), rotate_text_unit()
+ *                    lays the whole unit out once along its 40 char DDRAM row, followed by
+ *                    blanks, and then scrolls it across the full display width by shifting
+ *                    the display, which takes one instruction per position instead of
+ *                    rewriting the window. As soon as anything else is shown, rotation falls
+ *                    back to rewriting the unit's window.
+ *
+ * Input:             byte tag            :    Identifies a text unit. It must not jump rows.
+ *                    byte on             :    Set to "1" to enable marquee mode, "0" to disable it.
+ *****************************************************************************/
+void set_text_unit_marquee(byte tag, byte on);
+
+#ifdef LCD_STATS
+extern lcd_stats lcd_stats_counters;
+
+/******************************************************************************
+ * Summary:           Copies bus traffic and blocking time counted since the last
+ *                    lcd_stats_reset() into "stats".
+ *
+ * Input:             lcd_stats *stats    :    Where the counters will be copied.
+ *****************************************************************************/
+void lcd_stats_snapshot(lcd_stats *stats);
+
+/******************************************************************************
+ * Summary:           Sets all counters in lcd_stats to zero.
+ *****************************************************************************/
+void lcd_stats_reset(void);
+#endif
+
+#ifdef LCD_BUS_CUSTOM
+extern const lcd_bus *lcd_bus_backend;
+
+/******************************************************************************
+ * Summary:           Selects the backend through which the LCD will be driven.
+ *                    Must be called before initialize_lcd().
+ *
+ * Input:             const lcd_bus *bus  :    Backend's pin and delay functions.
+ *****************************************************************************/
+void lcd_set_bus(const lcd_bus *bus);
+#endif
+
+/******************************************************************************
+ * Summary:           Attaches an effect to the logical text unit identified by "tag", to be
+ *                    played by lcd_tick(). A unit has one effect at most; setting one replaces
+ *                    the previous one.
+ *
+ * Input:             byte tag            :    Identifies a text unit.
+ *                    byte direction      :    Input "RIGHT" or "LEFT", as in rotate_text_unit().
+ *                    byte stride         :    Positions rotated at each step.
+ *                    unsigned int period :    Time between two steps, in the units of "now".
+ *                    unsigned int on_time:    Time the unit is shown during each blink period,
+ *                                             from 1 to period-1. The call is ignored otherwise.
+ *                    unsigned int now    :    Current time. First step happens one period later.
+ *****************************************************************************/
+void set_text_unit_rotation(byte tag, byte direction, byte stride, unsigned int period, unsigned int now);
+void set_text_unit_blink(byte tag, unsigned int period, unsigned int on_time, unsigned int now);
+
+/******************************************************************************
+ * Summary:           Removes the effect of the logical text unit identified by "tag". A
+ *                    blinking unit is left shown.
+ *****************************************************************************/
+void clear_text_unit_effect(byte tag);
+
+/******************************************************************************
+ * Summary:           When frame mode is on, write_text(), write_char(), erase_line() and the
+ *                    text unit functions only update the driver's DDRAM mirror, and changes
+ *                    reach the LCD on the next lcd_tick(). Overlapping updates made between
+ *                    two ticks are thus sent once.
+ *
+ * Input:             byte on             :    Set to "1" to turn frame mode on, "0" to turn it off.
+ *****************************************************************************/
+void set_frame_mode(byte on);
+
+/******************************************************************************
+ * Summary:           Limits the bus time each lcd_tick() may spend sending a frame. Cells
+ *                    left over are sent on the following ticks.
+ *
+ * Input:             unsigned int budget_us :   Estimated bus time in us, 0 for no limit.
+ *****************************************************************************/
+void set_frame_budget(unsigned int budget_us);
+
+/******************************************************************************
+ * Summary:           Prepares "display" to drive another LCD sharing data, RS and RW
+ *                    lines with the first one, but with its own E line, and selects it.
+ *                    Call initialize_lcd() next. Each display keeps its own DDRAM mirror,
+ *                    text units and effects; all of them have the configured geometry.
+ *                    A 40x4 module is two displays of 40x2, one per controller.
+ *
+ * Input:             lcd_display *display :   Storage for the display's state.
+ *                    byte e_bit          :    Bit of LCD_E_PORT where its E line is connected.
+ *****************************************************************************/
+void lcd_setup_display(lcd_display *display, byte e_bit);
+
+/******************************************************************************
+ * Summary:           Makes every other function of this module act on "display". The
+ *                    display wired to LCD_E_BIT, lcd_main, is selected at start.
+ *
+ * Input:             lcd_display *display :   lcd_main or a display set up with
+ *                                             lcd_setup_display().
+ *****************************************************************************/
+void lcd_select(lcd_display *display);
+extern lcd_display lcd_main;
+
+/******************************************************************************
+ * Summary:           Sends every pending change of several displays, typically written
+ *                    in frame mode. While one controller executes a char, the bus
+ *                    serves the others, which only saves time when a char executes
+ *                    for longer than its enable cycles: with LCD_USE_RW (up to N times
+ *                    faster) or a slow LCD_EXEC_SCALE. Without RW at the nominal scale
+ *                    the enable cycles already cover the execution time, and with
+ *                    LCD_ASYNC transfers are only queued, so it takes as long as
+ *                    refreshing the displays one after the other, never longer.
+ *                    The selected display is left unchanged.
+ *
+ * Input:             lcd_display *displays[] :   Displays to refresh.
+ *                    byte amount         :    Length of displays[].
+ *****************************************************************************/
+void lcd_refresh(lcd_display *displays[], byte amount);
+
+/******************************************************************************
+ * Summary:           Steps every text unit effect that is due, then sends the cells that
+ *                    changed since the last tick, within the frame budget.
+ *
+ * Input:             unsigned int now    :    Current time, in any unit (e.g. ms). It may wrap
+ *                                             around; periods must stay below half its range.
+ * Output:            byte done           :    TRUE if the LCD shows the whole frame, FALSE if
+ *                                             cells were left for the next ticks.
+ *****************************************************************************/
+byte lcd_tick(unsigned int now);
+
+/******************************************************************************
+ * Summary:           Limits the bus time each lcd_scrub() may spend, and has lcd_tick()
+ *                    call it once the frame is sent. A pass takes about
+ *                    (DDRAM_SIZE*CHAR_COST_US + MODES_COST_US)/budget_us calls, plus
+ *                    8*CHAR_COST_US/budget_us for each glyph held in CGRAM. A pass also
+ *                    returns home, and shifts back when panned, over HOME_COST_US, in a
+ *                    call of its own when over the budget.
+ *
+ * Input:             unsigned int budget_us :   Estimated bus time in us, 0 to stop scrubbing
+ *                                               from lcd_tick().
+ *****************************************************************************/
+void set_scrub_budget(unsigned int budget_us);
+
+/******************************************************************************
+ * Summary:           Repairs an LCD disturbed by electrical noise, a few cells at a time,
+ *                    instead of a reset and full redraw. Each call goes on from where
+ *                    the last one stopped, through the function set, display control
+ *                    and entry mode, the display shift (a stray nibble may complete
+ *                    into a return home), every DDRAM cell, then every glyph in CGRAM,
+ *                    rewriting them from the driver's copies within the scrub budget.
+ *                    With LCD_USE_RW, and without LCD_ASYNC, DDRAM cells are read back
+ *                    and only those that differ are rewritten. Cells waiting in frame
+ *                    mode are left to the next flush.
+ *
+ * Output:            byte done           :    TRUE if this call finished a pass.
+ *****************************************************************************/
+byte lcd_scrub(void);
+
+#ifdef LCD_ASYNC
+/******************************************************************************
+ * Summary:           Clocks the next nibble of the transfer queue out to the LCD, or
+ *                    counts down the execution time of the last byte sent. Must be
+ *                    called every LCD_TICK_US us, either from a timer ISR (define
+ *                    LCD_ASYNC_ISR) or from the application's main loop.
+ *****************************************************************************/
+void lcd_service(void);
+
+/******************************************************************************
+ * Summary:           Returns how many bytes are waiting to be sent to the LCD.
+ *
+ * Output:            byte depth          :    Queued bytes, including the one being sent.
+ *****************************************************************************/
+byte lcd_queue_depth(void);
+#endif
+
+#ifdef LCD_POST
+/******************************************************************************
+ * Summary:           Post an operation for lcd_process() to run, from any task,
+ *                    thread or ISR. Posting is lock-free and never waits for the
+ *                    LCD: if the queue is full the operation is dropped. Each one
+ *                    is run whole, so texts posted by different producers never
+ *                    mix. They act on the display selected when lcd_process() runs.
+ *
+ * Input:             As write_text(), write_char(), gotoaddress(), clear_screen(),
+ *                    set_number() and set_bar(). The text is copied and must be
+ *                    shorter than LCD_POST_TEXT_SIZE. A posted lcd_number or lcd_bar
+ *                    must only be updated through posts.
+ * Output:            byte posted         :    TRUE if queued, FALSE if the queue was
+ *                                             full or the text too long.
+ *****************************************************************************/
+byte lcd_post_text(const char *str, byte start_address, byte jump);
+byte lcd_post_char(char ch);
+byte lcd_post_goto(byte address);
+byte lcd_post_clear(void);
+byte lcd_post_number(lcd_number *field, long value);
+byte lcd_post_bar(lcd_bar *bar, byte value);
+
+/******************************************************************************
+ * Summary:           Runs the posted operations, in the order they were posted.
+ *                    Must always be called from the same task, the only one that
+ *                    uses the rest of the driver.
+ *
+ * Output:            byte ran            :    Operations run.
+ *****************************************************************************/
+byte lcd_process(void);
+#endif
+
+/******************************************************************************
+ * Summary:           Blocks until every byte, queued or sent, has been executed by
+ *                    the LCD. Without LCD_ASYNC, waits for the selected display only.
+ *****************************************************************************/
+void lcd_flush(void);
+
 #endif /* LCD4BITS_H_ */
\ No newline at end of file
@@ -0,0 +1,545 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * Bus cost benchmark. Runs every public function of lcd4bits against the
+ * simulator and reports, per call, the enable pulses, bytes sent, instructions,
+ * total delay in us, busy violations, I2C transactions and host wall time. Results are written
+ * as CSV to stdout, or to the file given as first argument ("-" for stdout).
+ * If a previous CSV is given as second argument, every call whose simulated
+ * bus time grew is reported and the program exits with status 2.
+ *
+ * Each call must also leave no busy violation behind and, where the case has
+ * a check, the display must show what the call was meant to put on it.
+ * Failures are reported on stderr and the program exits with status 3.
+ *
+ *     gcc -O2 -DLCD_BUS_CUSTOM -o lcd_bench lcd_bench.c lcd4bits.c lcd_sim.c
+ *     ./lcd_bench bench.csv
+ *     ./lcd_bench - bench.csv
+ *
+ * Define LCD_BENCH_PCF8574, and add lcd_pcf8574.c, to go through the simulated
+ * I2C backpack instead of the LCD's pins, a string then has to go out in one
+ * transaction and a full row in two at most. lcd_bench.sh runs the bench in every
+ * configuration the driver supports.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "lcd_sim.h"
+
+/// DEFINITIONS
+
+#define BENCH_TIMES              200      // "times" used for cursor and screen moves
+#define BENCH_LINE_LEN           256
+#define BENCH_JUMP_TEXT          "0123456789ABCDEFGHIJKLMNOPQRSTUV"
+#define BENCH_JUMP_TEXT2         "abcdefghijklmnopqrstuvwxyz012345"
+#if CANVAS_WIDTH >= 2*DISPLAY_WIDTH
+#define BENCH_PAGE               DISPLAY_WIDTH    // Second page of the canvas
+#else
+#define BENCH_PAGE               0                // 4 rows, the canvas is the panel
+#endif
+#define BENCH_SECOND_E_BIT       ((LCD_E_BIT + 1) % 8)    // E line of the display lcd_refresh() shares the bus with
+#if LCD_ROWS > 2
+#define BENCH_MARQUEE_ROTATED    "queeMar"        // 4 rows, no display shifts, the window rotates
+#else
+#define BENCH_MARQUEE_ROTATED    "quee"
+#endif
+
+
+/// CASES
+
+byte tag, marquee, utf8_unit;
+byte scrub_saved, saved_control, saved_entry;
+lcd_bar bar;
+lcd_number counter;
+byte flash_unit, long_unit, too_long_unit, too_long_unit_P;
+char shown[LCD_COLS + 1];
+char too_long[300];
+lcd_display second;
+lcd_display *displays[] = {&lcd_main, &second};
+unsigned long sequential_us;
+byte offsets[]  = {1, 3};
+char chars[]    = {'#', '#'};
+const char flash_text[] PROGMEM = "From flash";
+const char flash_label[] PROGMEM = "Pressure";
+const byte glyphs[][8] PROGMEM = {
+    {0x04, 0x0E, 0x0E, 0x0E, 0x1F, 0x00, 0x04, 0x00},
+    {0x00, 0x0A, 0x1F, 0x1F, 0x0E, 0x04, 0x00, 0x00}
+};
+
+void bench_initialize(void)         { initialize_lcd(0, 0); }
+void bench_clear_screen(void)       { clear_screen(); }
+void bench_write_text(void)         { write_text("Temp: 21.5 C", L1_START, 0); }
+void bench_write_text_same(void)    { write_text("Temp: 21.5 C", L1_START, 0); }
+void bench_write_text_digit(void)   { write_text("Temp: 21.6 C", L1_START, 0); }
+void bench_write_text_jump(void)    { write_text(BENCH_JUMP_TEXT, L1_START, JUMP); }
+void bench_write_text_jump2(void)   { write_text(BENCH_JUMP_TEXT2, L1_START, JUMP); }
+void bench_write_char(void)         { write_char('*'); }
+void bench_erase_line(void)         { erase_line(L2_START); }
+void bench_gotoaddress(void)        { gotoaddress(L2_START + 4); }
+void bench_gohome(void)             { gohome(); }
+void bench_switch_display(void)     { switch_display(1); }
+void bench_move_cursor_right(void)  { move_cursor_right(BENCH_TIMES); }
+void bench_move_cursor_left(void)   { move_cursor_left(BENCH_TIMES); }
+void bench_move_screen_left(void)   { move_screen_left(BENCH_TIMES); }
+void bench_move_screen_right(void)  { move_screen_right(BENCH_TIMES); }
+void bench_register(void)           { tag = register_text_unit("Scrolling message ", DISPLAY_WIDTH, 0); }
+void bench_write_unit(void)         { write_text_unit(tag, L1_START); }
+void bench_move_unit(void)          { move_text_unit(tag, L2_START); }
+void bench_rotate_unit(void)        { rotate_text_unit(tag, LEFT, 1); }
+void bench_toggle_unit_off(void)    { toggle_text_unit(tag, 0); }
+void bench_toggle_unit_on(void)     { toggle_text_unit(tag, 1); }
+void bench_replace_chars(void)      { replace_chars_in_text_unit(tag, offsets, chars, 2); }
+void bench_return_unit(void)        { return_text_unit_to_initial_position(tag); }
+void bench_glyph_miss(void)         { set_glyph_table(&glyphs[0][0], 2); gotoaddress(L2_START); write_glyph(0); }
+void bench_glyph_hit(void)          { write_glyph(0); }
+void bench_setup_bar(void)          { setup_bar(&bar, 1, 0, DISPLAY_WIDTH, 0); }
+void bench_bar_step(void)           { set_bar(&bar, 37); }
+void bench_bar_next_cell(void)      { set_bar(&bar, 42); }
+void bench_setup_number(void)       { setup_number(&counter, 0, 0, 6, NUMBER_DEC); }
+void bench_set_number(void)         { set_number(&counter, 1234); }
+void bench_set_number_tick(void)    { set_number(&counter, 1235); }
+void bench_write_canvas(void)       { write_canvas("Page two", 0, BENCH_PAGE); }
+void bench_pan_page(void)           { pan_to(BENCH_PAGE); }
+void bench_pan_back(void)           { pan_to(0); }
+void bench_scrub_pass(void)         { scrub_saved = lcd_sim_ddram(L2_START + 3); lcd_sim_corrupt_ddram(L2_START + 3, '?');
+                                      lcd_sim_corrupt_shift(5); set_scrub_budget(0); lcd_scrub(); }
+void bench_scrub_tick(void)         { saved_control = lcd_sim_display_control(); saved_entry = lcd_sim_entry_mode();
+                                      lcd_sim_corrupt_modes(0, 0); set_scrub_budget(500); lcd_scrub(); }
+void bench_marquee(void)            { clear_screen(); marquee = register_text_unit("Marquee", 7, 0);
+                                      set_text_unit_marquee(marquee, 1); write_text_unit(marquee, L1_START); }
+void bench_rotate_marquee(void)     { rotate_text_unit(marquee, LEFT, 3); }
+#ifdef LCD_UTF8
+void bench_utf8_unit(void)          { clear_screen(); utf8_unit = register_text_unit("T=5\xC2\xB0" "C", 0, 0);
+                                      write_text_unit(utf8_unit, L1_START); }
+void bench_rotate_utf8_unit(void)   { rotate_text_unit(utf8_unit, LEFT, 3); }
+#endif
+
+// What row 0 shows, to be found again after a warm reset
+void bench_save_row(void){
+    byte col;
+    for (col = 0; col < LCD_COLS; col++) shown[col] = lcd_sim_visible(0, col);
+}
+
+void bench_warm_reset(void)         { bench_save_row(); saved_control = lcd_sim_display_control();
+                                      saved_entry = lcd_sim_entry_mode(); lcd_sim_corrupt_modes(0, 0);
+                                      lcd_sim_corrupt_shift(0); warm_reset_lcd(); }
+void bench_write_text_P(void)       { clear_screen(); write_text_P(flash_text, L1_START, 0); }
+// The freed tag must not show anything anymore
+void bench_unregister(void)         { unregister_text_unit(tag); unregister_text_unit(marquee);
+                                      write_text_unit(tag, L1_START); }
+// 40 chars, more than what is left at the end of the arena but not more than it holds once compacted
+void bench_register_compact(void)   { long_unit = register_text_unit("Compacted into the gaps of the arena ...",
+                                                                     DISPLAY_WIDTH, 0);
+                                      write_text_unit(long_unit, L1_START); }
+void bench_register_P(void)         { flash_unit = register_text_unit_P(flash_label, 0, 0);
+                                      write_text_unit(flash_unit, L1_START); }
+void bench_blink(void)              { set_text_unit_blink(flash_unit, 10, 6, 0); lcd_tick(0); }
+void bench_tick_blink_off(void)     { lcd_tick(6); }
+void bench_tick_blink_on(void)      { lcd_tick(10); }
+void bench_rotation(void)           { set_text_unit_rotation(flash_unit, LEFT, 2, 5, 10); lcd_tick(10); }
+void bench_tick_rotation(void)      { lcd_tick(15); }
+// 300 bytes, more than the arena holds and than a byte counts
+void bench_register_too_long(void)  { memset(too_long, '=', sizeof(too_long) - 1);
+                                      too_long_unit = register_text_unit(too_long, 0, 0);
+                                      too_long_unit_P = register_text_unit_P(too_long, 0, 0); }
+// Shown longer than its period, ignored rather than hidden for good
+void bench_blink_invalid(void)      { clear_text_unit_effect(flash_unit); set_text_unit_blink(flash_unit, 4, 6, 20);
+                                      lcd_tick(26); lcd_tick(30); lcd_tick(40); }
+#ifdef LCD_POST
+lcd_number posted_number;
+lcd_bar posted_bar;
+void bench_post(void)               { setup_number(&posted_number, 0, 8, 4, NUMBER_DEC); setup_bar(&posted_bar, 0, 12, 2, 0);
+                                      lcd_post_clear(); lcd_post_text("Posted", L1_START, 0);
+                                      lcd_post_goto(L1_START + 6); lcd_post_char('!');
+                                      lcd_post_number(&posted_number, 42); lcd_post_bar(&posted_bar, 2*BAR_H_STEPS);
+                                      lcd_process(); }
+#endif
+
+// Lays a frame for each display in its mirror, "a" for lcd_main, "b" for the second one
+void bench_frames(char a[], char b[]){
+    lcd_select(&second);
+    set_frame_mode(1);
+    write_text(b, L1_START, JUMP);
+    lcd_select(&lcd_main);
+    set_frame_mode(1);
+    write_text(a, L1_START, JUMP);
+}
+
+// Waits for the second display too, lcd_flush() covers the selected one only
+void bench_settle(void){
+    lcd_select(&second);
+    set_frame_mode(0);
+    lcd_flush();
+    lcd_select(&lcd_main);
+    set_frame_mode(0);
+}
+
+#ifndef LCD_BENCH_PCF8574
+// Ends with a frame sent, as the refresh cases do, so that both start from the same state
+void bench_setup_second(void)       { clear_screen(); lcd_setup_display(&second, BENCH_SECOND_E_BIT);
+                                      initialize_lcd(0, 0); bench_frames(BENCH_JUMP_TEXT2, BENCH_JUMP_TEXT);
+                                      lcd_refresh(displays, 2); bench_settle(); }
+void bench_refresh_sequential(void) { bench_frames(BENCH_JUMP_TEXT, BENCH_JUMP_TEXT2); lcd_refresh(displays, 1);
+                                      lcd_refresh(displays + 1, 1); bench_settle(); }
+void bench_refresh(void)            { bench_frames(BENCH_JUMP_TEXT2, BENCH_JUMP_TEXT); lcd_refresh(displays, 2);
+                                      bench_settle(); }
+#endif
+
+
+/// CHECKS
+
+const char *failed_case;
+int failures;
+lcd_sim_counters counters;
+unsigned long case_us;
+
+// Compares what row "row" shows, from column 0 on, with text[] or as much of it as fits
+void expect_row(byte row, const char *text){
+
+    byte col;
+
+    for (col = 0; col < LCD_COLS && text[col]; col++){
+        if (lcd_sim_visible(row, col) == text[col]) continue;
+        fprintf(stderr, "WRONG %s: row %u col %u shows 0x%02X, expected 0x%02X\n", failed_case,
+                row, col, (byte)lcd_sim_visible(row, col), (byte)text[col]);
+        failures++;
+        return;
+    }
+
+}
+
+// Compares the display with text[] laid out row after row, as write_text() with JUMP does
+void expect_text(const char *text){
+
+    byte row;
+
+    for (row = 0; row < LCD_ROWS && strlen(text) > row*LCD_COLS; row++)
+        expect_row(row, text + row*LCD_COLS);
+
+}
+
+// Checks that nothing is shown from column "col" of row "row" to the end of the display
+void expect_blank(byte row, byte col){
+
+    for ( ; row < LCD_ROWS; row++, col = 0)
+        for ( ; col < LCD_COLS; col++){
+            if (lcd_sim_visible(row, col) == ' ') continue;
+            fprintf(stderr, "WRONG %s: row %u col %u shows 0x%02X, expected a blank\n", failed_case,
+                    row, col, (byte)lcd_sim_visible(row, col));
+            failures++;
+            return;
+        }
+
+}
+
+// Compares the viewport with the canvas from column "col" on
+void expect_canvas(byte col){
+
+    byte row, i;
+
+    for (row = 0; row < LCD_ROWS; row++)
+        for (i = 0; i < DISPLAY_WIDTH; i++){
+            if ((byte)lcd_sim_visible(row, i) == lcd_sim_ddram(canvas_address(row, col + i))) continue;
+            fprintf(stderr, "WRONG %s: row %u col %u does not show canvas col %u\n", failed_case,
+                    row, i, col + i);
+            failures++;
+            return;
+        }
+
+}
+
+// Compares the DDRAM cell at "address" with the char it held before being corrupted
+void expect_cell(byte address, byte value){
+
+    if (lcd_sim_ddram(address) == value) return;
+    fprintf(stderr, "WRONG %s: DDRAM 0x%02X holds 0x%02X, expected 0x%02X\n", failed_case,
+            address, lcd_sim_ddram(address), value);
+    failures++;
+
+}
+
+// Compares the LCD's display control and entry mode with those they had before being corrupted
+void expect_modes(byte display_control, byte entry_mode){
+
+    if (lcd_sim_display_control() == display_control && lcd_sim_entry_mode() == entry_mode) return;
+    fprintf(stderr, "WRONG %s: display control 0x%02X, entry mode 0x%02X\n", failed_case,
+            lcd_sim_display_control(), lcd_sim_entry_mode());
+    failures++;
+
+}
+
+// Through the PCF8574, compares the I2C transactions the call took with the most it should take
+void expect_transactions(unsigned long most){
+
+#ifdef LCD_BENCH_PCF8574
+    if (counters.i2c_transactions <= most) return;
+    fprintf(stderr, "WRONG %s: %lu I2C transactions, expected %lu at most\n", failed_case,
+            counters.i2c_transactions, most);
+    failures++;
+#else
+    (void)most;
+#endif
+
+}
+
+void check_write_text(void)         { expect_row(0, "Temp: 21.5 C"); expect_transactions(1); }
+void check_write_text_digit(void)   { expect_row(0, "Temp: 21.6 C"); }
+void check_write_text_jump(void)    { expect_text(BENCH_JUMP_TEXT); expect_transactions(2); }
+void check_write_text_jump2(void)   { expect_text(BENCH_JUMP_TEXT2); expect_transactions(2); }
+void check_write_char(void)         { expect_transactions(1); }
+void check_pan_page(void)           { expect_row(0, "Page two"); expect_canvas(BENCH_PAGE); }
+void check_pan_back(void)           { expect_canvas(0); }
+void check_scrub_pass(void)         { expect_canvas(0); expect_cell(L2_START + 3, scrub_saved); }
+void check_scrub_tick(void)         { expect_modes(saved_control, saved_entry); }
+void check_marquee(void)            { expect_row(0, "Marquee"); expect_blank(0, 7); }
+void check_rotate_marquee(void)     { expect_row(0, BENCH_MARQUEE_ROTATED); expect_blank(0, sizeof(BENCH_MARQUEE_ROTATED) - 1); }
+void check_warm_reset(void)         { expect_modes(saved_control, saved_entry); expect_row(0, shown); }
+void check_write_text_P(void)       { expect_row(0, "From flash"); expect_blank(0, 10); }
+void check_register_compact(void)   { expect_row(0, "Compacted into the gaps of the arena ..."); }
+void check_register_P(void)         { expect_row(0, "Pressure"); }
+void check_blink_off(void)          { expect_row(0, "        "); }
+void check_rotation(void)           { expect_row(0, "essurePr"); }
+void check_register_too_long(void){
+
+    if (too_long_unit == NO_UNIT && too_long_unit_P == NO_UNIT) return;
+    fprintf(stderr, "WRONG %s: a %u bytes unit was registered\n", failed_case, (unsigned int)strlen(too_long));
+    failures++;
+
+}
+#ifdef LCD_POST
+void check_post(void)               { expect_row(0, "Posted!   42\xFF\xFF"); expect_blank(0, 14); }
+#endif
+
+#ifndef LCD_BENCH_PCF8574
+// Compares what the second display shows with text[]
+void expect_second(const char *text){
+    lcd_sim_select(BENCH_SECOND_E_BIT);
+    expect_text(text);
+    lcd_sim_select(LCD_E_BIT);
+}
+
+void check_refresh_sequential(void) { expect_text(BENCH_JUMP_TEXT); expect_second(BENCH_JUMP_TEXT2); sequential_us = case_us; }
+void check_refresh(void){
+
+    expect_text(BENCH_JUMP_TEXT2);
+    expect_second(BENCH_JUMP_TEXT);
+
+    // Serving one display while the other executes never costs more than one after the other,
+    // and less wherever a char takes longer to execute than its enable cycles
+#ifdef LCD_ASYNC
+    if (case_us <= sequential_us) return;
+#else
+    if (case_us < sequential_us || (case_us == sequential_us && !_exec_time(LCD_EXEC_WRITE_US))) return;
+#endif
+    fprintf(stderr, "WRONG %s: %lu us, %lu us one display after the other\n", failed_case,
+            case_us, sequential_us);
+    failures++;
+
+}
+#endif
+#ifdef LCD_UTF8
+// A 5 chars unit, the degree sign taking 2 bytes
+#ifdef LCD_ROM_A02
+#define BENCH_DEGREE             "\xB0"
+#else
+#define BENCH_DEGREE             "\xDF"
+#endif
+void check_utf8_unit(void)          { expect_row(0, "T=5" BENCH_DEGREE "C"); expect_blank(0, 5); }
+void check_rotate_utf8_unit(void)   { expect_row(0, BENCH_DEGREE "CT=5"); expect_blank(0, 5); }
+#endif
+
+typedef struct {
+    const char *name;
+    void (*run)(void);
+    void (*check)(void);
+} bench_case;
+
+// Run in order, each case starts from the display state left by the previous one
+const bench_case cases[] = {
+    {"initialize_lcd",                          bench_initialize,        NULL},
+    {"clear_screen",                            bench_clear_screen,      NULL},
+    {"write_text",                              bench_write_text,        check_write_text},
+    {"write_text_unchanged",                    bench_write_text_same,   NULL},
+    {"write_text_one_digit",                    bench_write_text_digit,  check_write_text_digit},
+    {"write_text_jump",                         bench_write_text_jump,   check_write_text_jump},
+    {"write_text_jump_all_changed",             bench_write_text_jump2,  check_write_text_jump2},
+    {"write_char",                              bench_write_char,        check_write_char},
+    {"erase_line",                              bench_erase_line,        NULL},
+    {"gotoaddress",                             bench_gotoaddress,       NULL},
+    {"gohome",                                  bench_gohome,            NULL},
+    {"switch_display",                          bench_switch_display,    NULL},
+    {"move_cursor_right_200",                   bench_move_cursor_right, NULL},
+    {"move_cursor_left_200",                    bench_move_cursor_left,  NULL},
+    {"move_screen_left_200",                    bench_move_screen_left,  NULL},
+    {"move_screen_right_200",                   bench_move_screen_right, NULL},
+    {"register_text_unit",                      bench_register,          NULL},
+    {"write_text_unit",                         bench_write_unit,        NULL},
+    {"move_text_unit",                          bench_move_unit,         NULL},
+    {"rotate_text_unit",                        bench_rotate_unit,       NULL},
+    {"toggle_text_unit_off",                    bench_toggle_unit_off,   NULL},
+    {"toggle_text_unit_on",                     bench_toggle_unit_on,    NULL},
+    {"replace_chars_in_text_unit",              bench_replace_chars,     NULL},
+    {"return_text_unit_to_initial_position",    bench_return_unit,       NULL},
+    {"write_glyph_miss",                        bench_glyph_miss,        NULL},
+    {"write_glyph_hit",                         bench_glyph_hit,         NULL},
+    {"setup_bar",                               bench_setup_bar,         NULL},
+    {"set_bar",                                 bench_bar_step,          NULL},
+    {"set_bar_next_cell",                       bench_bar_next_cell,     NULL},
+    {"setup_number",                            bench_setup_number,      NULL},
+    {"set_number",                              bench_set_number,        NULL},
+    {"set_number_one_digit",                    bench_set_number_tick,   NULL},
+    {"write_canvas",                            bench_write_canvas,      NULL},
+    {"pan_to_page",                             bench_pan_page,          check_pan_page},
+    {"pan_to_start",                            bench_pan_back,          check_pan_back},
+    {"lcd_scrub_pass",                          bench_scrub_pass,        check_scrub_pass},
+    {"lcd_scrub_500us",                         bench_scrub_tick,        check_scrub_tick},
+    {"write_text_unit_marquee",                 bench_marquee,           check_marquee},
+    {"rotate_text_unit_marquee",                bench_rotate_marquee,    check_rotate_marquee},
+#ifdef LCD_UTF8
+    {"write_text_unit_utf8",                    bench_utf8_unit,         check_utf8_unit},
+    {"rotate_text_unit_utf8",                   bench_rotate_utf8_unit,  check_rotate_utf8_unit},
+#endif
+    {"warm_reset_lcd",                          bench_warm_reset,        check_warm_reset},
+    {"write_text_P",                            bench_write_text_P,      check_write_text_P},
+    {"unregister_text_unit",                    bench_unregister,        check_write_text_P},
+    {"register_text_unit_compacting",           bench_register_compact,  check_register_compact},
+    {"register_text_unit_P",                    bench_register_P,        check_register_P},
+    {"set_text_unit_blink",                     bench_blink,             check_register_P},
+    {"lcd_tick_blink_off",                      bench_tick_blink_off,    check_blink_off},
+    {"lcd_tick_blink_on",                       bench_tick_blink_on,     check_register_P},
+    {"set_text_unit_rotation",                  bench_rotation,          check_register_P},
+    {"lcd_tick_rotation",                       bench_tick_rotation,     check_rotation},
+    {"set_text_unit_blink_longer_than_period",  bench_blink_invalid,     check_rotation},
+    {"register_text_unit_too_long",             bench_register_too_long, check_register_too_long},
+#ifdef LCD_POST
+    {"lcd_post_process",                        bench_post,              check_post},
+#endif
+#ifndef LCD_BENCH_PCF8574
+    // The backpack has a single E line
+    {"lcd_setup_display",                       bench_setup_second,      NULL},
+    {"lcd_refresh_one_by_one",                  bench_refresh_sequential, check_refresh_sequential},
+    {"lcd_refresh_2_displays",                  bench_refresh,           check_refresh},
+#endif
+};
+
+#define CASES_AMT                (sizeof(cases)/sizeof(cases[0]))
+
+unsigned long bus_us[CASES_AMT];
+
+
+int compare_baseline(const char *path){
+
+    FILE *in;
+    char line[BENCH_LINE_LEN], name[BENCH_LINE_LEN];
+    unsigned long pulses, bytes, instructions, writes, delay, bus;
+    unsigned int i;
+    int regressions;
+
+    in = fopen(path, "r");
+    if (!in){
+        perror(path);
+        return -1;
+    }
+
+    regressions = 0;
+    while (fgets(line, sizeof(line), in)){
+
+        if (sscanf(line, "%255[^,],%lu,%lu,%lu,%lu,%lu,%lu", name, &pulses, &bytes,
+                   &instructions, &writes, &delay, &bus) != 7) continue;
+
+        for (i = 0; i < CASES_AMT; i++){
+            if (strcmp(name, cases[i].name) || bus_us[i] <= bus) continue;
+            fprintf(stderr, "REGRESSION %s: %lu us -> %lu us\n", name, bus, bus_us[i]);
+            regressions++;
+        }
+
+    }
+
+    fclose(in);
+    return regressions;
+
+}
+
+int main(int argc, char *argv[]){
+
+    FILE *out;
+    unsigned int i;
+    unsigned long start_us;
+    struct timespec start, end;
+    double wall_ns;
+    int regressions;
+
+    out = argc > 1 && strcmp(argv[1], "-") ? fopen(argv[1], "w") : stdout;
+    if (!out){
+        perror(argv[1]);
+        return 1;
+    }
+
+    // A clone as slow as LCD_EXEC_SCALE allows for
+    lcd_sim_reset(LCD_SIM_FOSC_KHZ*100UL/LCD_EXEC_SCALE);
+#ifdef LCD_BENCH_PCF8574
+    lcd_pcf8574_setup(&lcd_sim_i2c, LCD_SIM_PCF8574_ADDRESS);
+    lcd_set_bus(&lcd_pcf8574_bus);
+#else
+    lcd_set_bus(&lcd_sim_bus);
+#endif
+
+    fprintf(out, "call,enable_pulses,bytes,instructions,data_writes,delay_us,bus_us,busy_violations,i2c_transactions,wall_ns\n");
+
+    for (i = 0; i < CASES_AMT; i++){
+
+        lcd_sim_clear_counters();
+        start_us = lcd_sim_elapsed_us();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        cases[i].run();
+        lcd_flush();
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        counters = lcd_sim_get_counters();
+        wall_ns = (end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec);
+        bus_us[i] = lcd_sim_elapsed_us() - start_us;
+        case_us = bus_us[i];
+
+        failed_case = cases[i].name;
+        if (cases[i].check) cases[i].check();
+        if (counters.busy_violations){
+            fprintf(stderr, "BUSY %s: %lu busy violations\n", cases[i].name, counters.busy_violations);
+            failures++;
+        }
+
+        fprintf(out, "%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%.0f\n", cases[i].name,
+                counters.enable_pulses, counters.bytes_written, counters.instructions, counters.data_writes,
+                counters.delay_us, bus_us[i], counters.busy_violations, counters.i2c_transactions, wall_ns);
+
+    }
+
+    if (out != stdout) fclose(out);
+
+    regressions = argc > 2 ? compare_baseline(argv[2]) : 0;
+    if (regressions < 0) return 1;
+    if (failures) return 3;
+
+    return regressions ? 2 : 0;
+
+}
@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Builds lcd_bench in every configuration the driver must stay correct in, and
+# runs it. Each run fails on a busy violation or a wrong display content, and,
+# given a baseline directory, on a bus time regression. Options that take a
+# value in the CUSTOMIZE block of lcd4bits.h are edited in a copy of the sources.
+# The host tests are built and run after it.
+#
+#     ./lcd_bench.sh                       checks only
+#     ./lcd_bench.sh results               also writes results/<configuration>.csv
+#     ./lcd_bench.sh results baseline      and compares them with baseline/<configuration>.csv
+#
+
+CC=${CC:-gcc}
+CXX=${CXX:-g++}
+SRC=$(cd "$(dirname "$0")" && pwd)
+OUT=$1
+BASELINE=$2
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+[ -n "$OUT" ] && mkdir -p "$OUT"
+status=0
+
+# bench <configuration> <sed script applied to lcd4bits.h> [compiler flags]
+bench(){
+
+    name=$1
+    edit=$2
+    shift 2
+    sources="lcd_bench.c lcd4bits.c lcd_sim.c"
+    case " $* " in
+        *" -DLCD_BENCH_PCF8574 "*) sources="$sources lcd_pcf8574.c" ;;
+    esac
+
+    mkdir "$WORK/$name"
+    cp "$SRC"/lcd4bits.c "$SRC"/lcd_sim.c "$SRC"/lcd_sim.h "$SRC"/lcd_pcf8574.c "$SRC"/lcd_pcf8574.h \
+       "$SRC"/lcd_bench.c "$WORK/$name/"
+    sed "$edit" "$SRC/lcd4bits.h" > "$WORK/$name/lcd4bits.h"
+
+    if ! (cd "$WORK/$name" && $CC -O2 -DLCD_BUS_CUSTOM "$@" -o lcd_bench $sources); then
+        echo "$name: BUILD FAILED"
+        status=1
+        return
+    fi
+
+    csv=${OUT:+$OUT/$name.csv}
+    if [ -n "$BASELINE" ] && [ -f "$BASELINE/$name.csv" ]; then
+        "$WORK/$name/lcd_bench" "${csv:-/dev/null}" "$BASELINE/$name.csv"
+    else
+        "$WORK/$name/lcd_bench" "${csv:-/dev/null}"
+    fi
+
+    case $? in
+        0) echo "$name: ok" ;;
+        2) echo "$name: BUS TIME REGRESSED"; status=1 ;;
+        3) echo "$name: CHECKS FAILED"; status=1 ;;
+        *) echo "$name: FAILED"; status=1 ;;
+    esac
+
+}
+
+bench pins              ""
+bench rw                ""      -DLCD_USE_RW
+bench async             ""      -DLCD_ASYNC
+bench rw_async          ""      -DLCD_USE_RW -DLCD_ASYNC
+bench 8bit              ""      -DLCD_8BIT
+bench 8bit_async        ""      -DLCD_8BIT -DLCD_ASYNC
+bench 8bit_rw_async     ""      -DLCD_8BIT -DLCD_USE_RW -DLCD_ASYNC
+bench pcf8574           ""      -DLCD_BENCH_PCF8574
+bench utf8              ""      -DLCD_UTF8
+bench utf8_a02          ""      -DLCD_UTF8 -DLCD_ROM_A02
+bench post              ""      -DLCD_POST
+
+geometry_20x4='s|^#define LCD_COLS .*|#define LCD_COLS 20|; s|^#define LCD_ROWS .*|#define LCD_ROWS 4|'
+geometry_16x1='s|^#define LCD_ROWS .*|#define LCD_ROWS 1|'
+bench 20x4              "$geometry_20x4"
+bench 20x4_rw_async     "$geometry_20x4" -DLCD_USE_RW -DLCD_ASYNC
+bench 20x4_pcf8574      "$geometry_20x4" -DLCD_BENCH_PCF8574
+bench 16x1              "$geometry_16x1"
+bench 16x1_async        "$geometry_16x1" -DLCD_ASYNC
+
+slow='s|^#define LCD_EXEC_SCALE .*|#define LCD_EXEC_SCALE 200|'
+bench slow              "$slow"
+bench slow_async        "$slow" -DLCD_ASYNC
+bench slow_8bit         "$slow" -DLCD_8BIT
+bench slow_8bit_async   "$slow" -DLCD_8BIT -DLCD_ASYNC
+
+# host_test <test> <command building it in a copy of the sources>
+host_test(){
+
+    name=$1
+    mkdir "$WORK/$name"
+    cp "$SRC"/*.c "$SRC"/*.h "$SRC"/*.cpp "$SRC"/*.hpp "$WORK/$name/"
+
+    if ! (cd "$WORK/$name" && eval "$2"); then
+        echo "$name: BUILD FAILED"
+        status=1
+        return
+    fi
+
+    if (cd "$WORK/$name" && ./"$name"); then
+        echo "$name: ok"
+    else
+        echo "$name: FAILED"
+        status=1
+    fi
+
+}
+
+host_test hd44780_test  '$CC -c -DLCD_BUS_CUSTOM lcd_sim.c && $CXX -DLCD_BUS_CUSTOM -o hd44780_test hd44780_test.cpp lcd_sim.o'
+
+# Four producers posting to one consumer, under ThreadSanitizer
+post_test='-g -O1 -fsanitize=thread -DLCD_BUS_CUSTOM -DLCD_POST lcd_post_test.c lcd4bits.c lcd_sim.c -lpthread'
+host_test lcd_post_test '$CC $post_test -o lcd_post_test'
+host_test lcd_post_test_async '$CC $post_test -DLCD_ASYNC -o lcd_post_test_async'
+
+exit $status
@@ -0,0 +1,174 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+#include "lcd_pcf8574.h"
+
+/// STATE
+
+const lcd_i2c   *pcf_i2c;
+byte            pcf_address;
+byte            pcf_pins;                   // Outputs as the driver last set them
+byte            pcf_sent;                   // Outputs as the LCD will see them once the burst is sent
+byte            pcf_burst[LCD_PCF8574_BURST];
+byte            pcf_length;
+unsigned long   pcf_skipped;                // Delays asked for since the burst's first byte, not waited
+
+void pcf_set_data(byte data);
+void pcf_set_en(byte mask, byte level);
+void pcf_set_rs(byte level);
+void pcf_set_rw(byte level);
+void pcf_data_dir(byte input);
+byte pcf_get_data(void);
+void pcf_delay_us(unsigned long us);
+void pcf_flush(void);
+void pcf_queue(byte pins);
+
+const lcd_bus lcd_pcf8574_bus = {
+    pcf_set_data,
+    pcf_set_en,
+    pcf_set_rs,
+    pcf_set_rw,
+    pcf_data_dir,
+    pcf_get_data,
+    pcf_delay_us,
+    pcf_flush
+};
+
+
+void lcd_pcf8574_setup(const lcd_i2c *i2c, byte address){
+
+    pcf_i2c     = i2c;
+    pcf_address = address;
+    pcf_pins    = LCD_PCF8574_BACKLIGHT;
+    pcf_sent    = ~pcf_pins;
+    pcf_length  = 0;
+    pcf_skipped = 0;
+
+}
+
+void lcd_pcf8574_backlight(byte on){
+
+    if (on) pcf_pins |= LCD_PCF8574_BACKLIGHT;
+    else pcf_pins &= ~LCD_PCF8574_BACKLIGHT;
+
+    pcf_queue(pcf_pins);
+    pcf_flush();
+
+}
+
+
+/// BUS BACKEND
+
+void pcf_set_data(byte data){
+    pcf_pins = (pcf_pins & ~LCD_PCF8574_DATA_MASK) | ((data << LCD_PCF8574_DATA_LSB) & LCD_PCF8574_DATA_MASK);
+}
+
+void pcf_set_en(byte mask, byte level){
+
+    // One LCD per expander, whatever its E line is on a GPIO bus
+    (void)mask;
+
+    if (level){
+
+        // RS and RW must settle before E rises, data only before it falls
+        if ((pcf_pins ^ pcf_sent) & (LCD_PCF8574_RS | LCD_PCF8574_RW))
+            pcf_queue(pcf_pins & ~LCD_PCF8574_E);
+        pcf_pins |= LCD_PCF8574_E;
+
+    }else{
+
+        pcf_pins &= ~LCD_PCF8574_E;
+
+    }
+
+    pcf_queue(pcf_pins);
+
+}
+
+void pcf_set_rs(byte level){
+    if (level) pcf_pins |= LCD_PCF8574_RS;
+    else pcf_pins &= ~LCD_PCF8574_RS;
+}
+
+void pcf_set_rw(byte level){
+    if (level) pcf_pins |= LCD_PCF8574_RW;
+    else pcf_pins &= ~LCD_PCF8574_RW;
+}
+
+void pcf_data_dir(byte input){
+    // Quasi-bidirectional outputs: high ones are weak pull-ups the LCD can drive low
+    if (input) pcf_pins |= LCD_PCF8574_DATA_MASK;
+}
+
+byte pcf_get_data(void){
+
+    // E is high, the LCD only drives the data lines once the burst has raised it
+    pcf_flush();
+
+    return (pcf_i2c->read(pcf_address) & LCD_PCF8574_DATA_MASK) >> LCD_PCF8574_DATA_LSB;
+
+}
+
+void pcf_delay_us(unsigned long us){
+
+    unsigned long covered;
+    byte pad;
+
+    // The next byte of the burst reaches the LCD a byte time after each of those
+    // before it, delays adding up to no more than that are over by then
+    covered = pcf_length * (unsigned long)LCD_PCF8574_BYTE_NS / 1000;
+    pcf_skipped += us;
+    if (pcf_skipped <= covered) return;
+
+    // A byte or two short, e.g. the enable pulse of a lone char, the outputs are sent
+    // again rather than ending the transaction
+    pad = ((pcf_skipped - covered) * 1000 + LCD_PCF8574_BYTE_NS - 1) / LCD_PCF8574_BYTE_NS;
+    if (pcf_length && pad <= LCD_PCF8574_PAD_MAX && pcf_length + pad <= LCD_PCF8574_BURST){
+        while (pad--) pcf_queue(pcf_sent);
+        return;
+    }
+
+    // Otherwise send the burst, and wait for what its transfer did not cover
+    us = pcf_skipped - covered;
+    pcf_flush();
+    pcf_i2c->delay_us(us);
+
+}
+
+void pcf_flush(void){
+
+    // Whatever was skipped is over once the burst has gone out
+    pcf_skipped = 0;
+    if (!pcf_length) return;
+
+    pcf_i2c->write(pcf_address, pcf_burst, pcf_length);
+    pcf_length = 0;
+
+}
+
+void pcf_queue(byte pins){
+
+    if (pcf_length == LCD_PCF8574_BURST) pcf_flush();
+
+    pcf_burst[pcf_length++] = pins;
+    pcf_sent = pins;
+
+}
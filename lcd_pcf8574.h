@@ -0,0 +1,111 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * lcd_bus backend for the PCF8574 I2C backpack. The expander's 8 outputs drive
+ * RS, RW, E, the backlight and DB4..DB7, so every pin change is an I2C byte.
+ * Bytes are packed into bursts: each nibble costs two bytes, data with E high
+ * then data with E low, and a whole string goes out as one I2C transaction.
+ * Short enable and execution waits are covered by the time each byte takes on
+ * the bus, repeating the outputs if a byte or two short; longer waits and busy
+ * flag reads send the burst first.
+ *
+ * Provide the I2C transfers of your platform in an lcd_i2c, then
+ *
+ *     gcc -DLCD_BUS_CUSTOM app.c lcd4bits.c lcd_pcf8574.c i2c.c
+ *
+ *     lcd_pcf8574_setup(&my_i2c, 0x27);
+ *     lcd_set_bus(&lcd_pcf8574_bus);
+ *     initialize_lcd(0, 0);
+ *
+ * With LCD_USE_RW each transfer reads the busy flag first, which splits bursts;
+ * leave it undefined unless RW is really needed. One LCD per expander.
+ */
+
+#ifndef LCD_PCF8574_H_
+#define LCD_PCF8574_H_
+
+#include "lcd4bits.h"
+
+/************************************************************/
+/************** CUSTOMIZE HERE ******************************/
+
+/// Expander pins, as wired on the common backpacks
+#define LCD_PCF8574_RS           0x01     // P0
+#define LCD_PCF8574_RW           0x02     // P1
+#define LCD_PCF8574_E            0x04     // P2
+#define LCD_PCF8574_BACKLIGHT    0x08     // P3
+#define LCD_PCF8574_DATA_LSB     4        // DB4..DB7 on P4..P7
+
+/// Bursts
+#define LCD_PCF8574_BURST        (4*(LCD_COLS+1)+2)    // Bytes buffered before a transaction is forced. Fits
+                                                        // a SET_ADDRESS and a full row, 4 bytes per transfer,
+                                                        // plus one to settle RS before each of them
+#define LCD_PCF8574_BYTE_NS      22500    // Shortest time one byte takes on the bus, 9 clocks at 400 kHz
+
+/************************************************************/
+/************************************************************/
+
+#ifndef LCD_BUS_CUSTOM
+#error "The PCF8574 backend needs LCD_BUS_CUSTOM"
+#endif
+#ifdef LCD_8BIT
+#error "The PCF8574 backpack only wires DB4..DB7"
+#endif
+
+
+/// DEFINITIONS
+
+#define LCD_PCF8574_DATA_MASK    ( 0x0F << LCD_PCF8574_DATA_LSB )
+#define LCD_PCF8574_PAD_MAX      2        // Bytes repeated to cover a wait rather than ending the transaction,
+                                          // about what a new one costs in START, address and STOP
+
+
+/// TYPE DEFINITIONS
+
+typedef struct {
+    void (*write)(byte address, const byte *data, byte length);    // One write transaction, START to STOP
+    byte (*read)(byte address);                                     // One byte read transaction
+    void (*delay_us)(unsigned long us);
+} lcd_i2c;
+
+
+/// PROTOTYPES
+
+extern const lcd_bus lcd_pcf8574_bus;
+
+/******************************************************************************
+ * Summary:         Selects the I2C transfers and the address of the expander.
+ *                  Must be called before lcd_set_bus(&lcd_pcf8574_bus). The
+ *                  backlight starts on.
+ *
+ * Input:           const lcd_i2c *i2c   :    Platform's I2C transfers and delay.
+ *                  byte address         :    7 bit address, 0x20 to 0x27 for the
+ *                                            PCF8574, 0x38 to 0x3F for the PCF8574A.
+ *****************************************************************************/
+void lcd_pcf8574_setup(const lcd_i2c *i2c, byte address);
+
+/******************************************************************************
+ * Summary:         Turns the backlight on or off.
+ *****************************************************************************/
+void lcd_pcf8574_backlight(byte on);
+
+#endif /* LCD_PCF8574_H_ */
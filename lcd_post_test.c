@@ -0,0 +1,147 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * Host test of LCD_POST. Four threads post texts as fast as they can while
+ * the main thread runs them with lcd_process() against the simulator. Every
+ * post must run exactly once, no busy violation may happen, and each row must
+ * end up holding the last text of one of its producers, whole. Build it with
+ * ThreadSanitizer, which exits with status 66 on a data race; the test itself
+ * exits with status 3 on a failure.
+ *
+ *     gcc -g -O1 -fsanitize=thread -DLCD_BUS_CUSTOM -DLCD_POST -o lcd_post_test \
+ *         lcd_post_test.c lcd4bits.c lcd_sim.c -lpthread
+ *     ./lcd_post_test
+ *
+ * lcd_bench.sh runs it with and without LCD_ASYNC.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include "lcd_sim.h"
+
+/// DEFINITIONS
+
+#define PRODUCERS                4
+#define POSTS                    2000     // Per producer
+#define TEXT_LEN                 14       // "T<id> <post> <5 times the id's letter>"
+
+
+/// PRODUCERS
+
+atomic_int producers_done;
+unsigned long retries[PRODUCERS];
+
+void format_text(char text[], long id, int post){
+    snprintf(text, TEXT_LEN + 1, "T%ld %05d %c%c%c%c%c", id, post, (int)('a' + id), (int)('a' + id),
+             (int)('a' + id), (int)('a' + id), (int)('a' + id));
+}
+
+// Even producers write row 0, odd ones row 1. A full queue is retried, so none is lost
+void *producer(void *arg){
+
+    long id;
+    int i;
+    char text[TEXT_LEN + 1];
+
+    id = (long)arg;
+    for (i = 0; i < POSTS; i++){
+        format_text(text, id, i);
+        while (!lcd_post_text(text, id & 1 ? L2_START : L1_START, 0)){
+            retries[id]++;
+            sched_yield();
+        }
+    }
+
+    atomic_fetch_add(&producers_done, 1);
+    return NULL;
+
+}
+
+
+/// CHECKS
+
+int failures;
+
+// Row "row" must hold, whole, the last text of a producer of that row
+void expect_last_text(byte row){
+
+    char shown[TEXT_LEN + 1], expected[TEXT_LEN + 1];
+    byte i;
+    long id;
+
+    for (i = 0; i < TEXT_LEN; i++)
+        shown[i] = lcd_sim_ddram((row ? L2_START : L1_START) + i);
+    shown[TEXT_LEN] = '\0';
+
+    id = shown[1] - '0';
+    if (id >= 0 && id < PRODUCERS && (id & 1) == row){
+        format_text(expected, id, POSTS - 1);
+        if (!strcmp(shown, expected)) return;
+    }
+
+    fprintf(stderr, "WRONG row %u: \"%s\"\n", row, shown);
+    failures++;
+
+}
+
+int main(void){
+
+    pthread_t threads[PRODUCERS];
+    unsigned long ran;
+    long id;
+
+    lcd_sim_reset(LCD_SIM_FOSC_KHZ);
+    lcd_set_bus(&lcd_sim_bus);
+    initialize_lcd(0, 0);
+
+    for (id = 0; id < PRODUCERS; id++)
+        pthread_create(&threads[id], NULL, producer, (void *)id);
+
+    // The consumer, the only thread using the rest of the driver
+    ran = 0;
+    while (atomic_load(&producers_done) < PRODUCERS)
+        ran += lcd_process();
+    for (id = 0; id < PRODUCERS; id++)
+        pthread_join(threads[id], NULL);
+    ran += lcd_process();
+    lcd_flush();
+
+    if (ran != PRODUCERS*POSTS){
+        fprintf(stderr, "WRONG %lu posts ran, %u posted\n", ran, PRODUCERS*POSTS);
+        failures++;
+    }
+    if (lcd_sim_get_counters().busy_violations){
+        fprintf(stderr, "BUSY %lu busy violations\n", lcd_sim_get_counters().busy_violations);
+        failures++;
+    }
+    expect_last_text(0);
+    expect_last_text(1);
+
+    printf("%lu posts ran, %lu %lu %lu %lu retries on a full queue\n", ran,
+           retries[0], retries[1], retries[2], retries[3]);
+
+    return failures ? 3 : 0;
+
+}
@@ -0,0 +1,519 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+#include "lcd_sim.h"
+
+/// DEFINITIONS
+
+#define SIM_POWER_ON_US          15000    // Busy after power on, before any instruction is accepted
+#define SIM_INIT1_US             4100     // Execution time of the 1st function set of the init sequence
+#define SIM_INIT2_US             100      // Execution time of the 2nd function set of the init sequence
+#define SIM_EXEC_US              37
+#define SIM_EXEC_HOME_US         1520
+#define SIM_ADD_US               4        // Address counter update after a data read/write
+
+
+/// STATE
+
+typedef struct {
+
+    byte            en;
+
+    // Interface
+    byte            four_bit;
+    byte            nibble_phase;           // 2nd half of a 4 bit transfer is next
+    byte            high_nibble;
+    byte            read_value;
+    byte            init_writes;            // 8 bit function sets received since power on
+
+    // Controller
+    byte            ddram[LCD_SIM_DDRAM_SIZE];
+    byte            cgram[LCD_SIM_CGRAM_SIZE];
+    byte            ac;
+    byte            cgram_selected;
+    byte            two_lines;
+    byte            shift;
+    byte            control;
+    byte            entry;
+
+    // Time
+    unsigned int    fosc_khz;
+    unsigned long   busy_until;
+
+} lcd_sim_controller;
+
+typedef struct {
+
+    // Pins shared by every controller
+    byte            data;                   // DB0..DB7, unwired lines read as 0
+    byte            rs;
+    byte            rw;
+    byte            expander;               // PCF8574 outputs
+
+    unsigned long   now;
+    lcd_sim_counters counters;
+
+} lcd_sim_state;
+
+lcd_sim_state sim;
+lcd_sim_controller controllers[LCD_SIM_CONTROLLERS];
+lcd_sim_controller *ctl;                    // Controller whose E line is being toggled
+lcd_sim_controller *queried;                // Controller lcd_sim_ddram() and the like report on
+
+void sim_set_data(byte value);
+void sim_set_en(byte mask, byte level);
+void sim_edge(byte level);
+void sim_set_rs(byte level);
+void sim_set_rw(byte level);
+void sim_data_dir(byte input);
+byte sim_get_data(void);
+void sim_delay_us(unsigned long us);
+#ifndef LCD_8BIT
+void sim_i2c_write(byte address, const byte *data, byte length);
+byte sim_i2c_read(byte address);
+void sim_expander_out(byte pins);
+#endif
+
+void sim_write(byte rs, byte value);
+byte sim_read(byte rs);
+void sim_busy_for(unsigned int us);
+byte sim_ddram_index(lcd_sim_controller *c, byte address);
+void sim_move_ac(byte right);
+void sim_shift_display(byte left);
+
+const lcd_bus lcd_sim_bus = {
+    sim_set_data,
+    sim_set_en,
+    sim_set_rs,
+    sim_set_rw,
+    sim_data_dir,
+    sim_get_data,
+    sim_delay_us,
+    NULL
+};
+
+#ifndef LCD_8BIT
+const lcd_i2c lcd_sim_i2c = {
+    sim_i2c_write,
+    sim_i2c_read,
+    sim_delay_us
+};
+#endif
+
+
+void lcd_sim_reset(unsigned int fosc_khz){
+
+    byte i;
+
+    memset(&sim, 0, sizeof(sim));
+    memset(controllers, 0, sizeof(controllers));
+
+    for (i = 0; i < LCD_SIM_CONTROLLERS; i++){
+
+        // Internal reset circuit: 8 bit interface, 1 line, display off, increment
+        memset(controllers[i].ddram, ' ', LCD_SIM_DDRAM_SIZE);
+        controllers[i].entry = 0x02;
+        controllers[i].fosc_khz = fosc_khz ? fosc_khz : LCD_SIM_FOSC_KHZ;
+        controllers[i].busy_until = SIM_POWER_ON_US;
+
+    }
+
+    ctl = queried = &controllers[LCD_E_BIT];
+
+}
+
+void lcd_sim_select(byte e_bit){
+    queried = &controllers[e_bit % LCD_SIM_CONTROLLERS];
+}
+
+unsigned long lcd_sim_elapsed_us(void){
+    return sim.now;
+}
+
+void lcd_sim_advance_us(unsigned long us){
+    sim.now += us;
+}
+
+lcd_sim_counters lcd_sim_get_counters(void){
+    return sim.counters;
+}
+
+void lcd_sim_clear_counters(void){
+    memset(&sim.counters, 0, sizeof(sim.counters));
+}
+
+byte lcd_sim_ddram(byte address){
+    return queried->ddram[sim_ddram_index(queried, address)];
+}
+
+byte lcd_sim_cgram(byte address){
+    return queried->cgram[address & (LCD_SIM_CGRAM_SIZE - 1)];
+}
+
+char lcd_sim_visible(byte row, byte col){
+
+    if (!queried->two_lines)
+        return queried->ddram[(col + queried->shift) % LCD_SIM_DDRAM_SIZE];
+
+    // Rows 3 and 4 of a 4 row panel show lines 1 and 2 from column LCD_COLS on
+    if (row > 1) col += LCD_COLS;
+    return queried->ddram[(row & 1 ? LCD_SIM_DDRAM_SIZE/2 : 0) + (col + queried->shift) % (LCD_SIM_DDRAM_SIZE/2)];
+
+}
+
+byte lcd_sim_address_counter(void){
+    return queried->ac;
+}
+
+byte lcd_sim_display_shift(void){
+    return queried->shift;
+}
+
+byte lcd_sim_display_control(void){
+    return queried->control;
+}
+
+byte lcd_sim_entry_mode(void){
+    return queried->entry;
+}
+
+void lcd_sim_corrupt_ddram(byte address, byte value){
+    queried->ddram[sim_ddram_index(queried, address)] = value;
+}
+
+void lcd_sim_corrupt_cgram(byte address, byte value){
+    queried->cgram[address & (LCD_SIM_CGRAM_SIZE - 1)] = value;
+}
+
+void lcd_sim_corrupt_modes(byte display_control, byte entry_mode){
+    queried->control = display_control & 0x07;
+    queried->entry = entry_mode & 0x03;
+}
+
+void lcd_sim_corrupt_shift(byte shift){
+    queried->shift = shift;
+}
+
+
+/// BUS BACKEND
+
+void sim_set_data(byte value){
+#ifdef LCD_8BIT
+    sim.data = value;
+#else
+    // Only DB4..DB7 are wired
+    sim.data = value << 4;
+#endif
+}
+
+void sim_set_en(byte mask, byte level){
+
+    byte i;
+
+    for (i = 0; i < LCD_SIM_CONTROLLERS; i++){
+        if (!(mask & (1 << i))) continue;
+        ctl = &controllers[i];
+        sim_edge(level);
+    }
+
+}
+
+void sim_edge(byte level){
+
+    level = level ? 1 : 0;
+    if (level == ctl->en) return;
+    ctl->en = level;
+
+    if (level){
+
+        sim.counters.enable_pulses++;
+
+        // LCD drives the data lines while E is high
+        if (sim.rw && (!ctl->four_bit || !ctl->nibble_phase))
+            ctl->read_value = sim_read(sim.rs);
+
+        return;
+
+    }
+
+    // Falling edge
+    if (sim.rw){
+
+        if (ctl->four_bit && !ctl->nibble_phase){
+            ctl->nibble_phase = 1;
+            return;
+        }
+        ctl->nibble_phase = 0;
+        sim.counters.reads++;
+
+    }else if (!ctl->four_bit){
+
+        sim_write(sim.rs, sim.data);
+
+    }else if (!ctl->nibble_phase){
+
+        ctl->high_nibble = sim.data >> 4;
+        ctl->nibble_phase = 1;
+
+    }else{
+
+        ctl->nibble_phase = 0;
+        sim_write(sim.rs, (ctl->high_nibble << 4) | (sim.data >> 4));
+
+    }
+
+}
+
+void sim_set_rs(byte level){
+    sim.rs = level ? 1 : 0;
+}
+
+void sim_set_rw(byte level){
+    sim.rw = level ? 1 : 0;
+}
+
+void sim_data_dir(byte input){
+    (void)input;
+}
+
+byte sim_get_data(void){
+
+    byte lines;
+
+    if (!sim.rw || !ctl->en) lines = sim.data;
+    else if (!ctl->four_bit) lines = ctl->read_value;
+    else lines = ctl->nibble_phase ? ctl->read_value << 4 : ctl->read_value & 0xF0;
+
+#ifdef LCD_8BIT
+    return lines;
+#else
+    return lines >> 4;
+#endif
+
+}
+
+void sim_delay_us(unsigned long us){
+    sim.now += us;
+    sim.counters.delay_us += us;
+}
+
+
+/// PCF8574 EXPANDER
+
+#ifndef LCD_8BIT
+void sim_i2c_write(byte address, const byte *data, byte length){
+
+    byte i;
+
+    // Not acknowledged
+    if (address != LCD_SIM_PCF8574_ADDRESS) return;
+
+    sim.counters.i2c_transactions++;
+    sim.now += LCD_SIM_I2C_BYTE_US;
+
+    // Outputs change as each byte is acknowledged
+    for (i = 0; i < length; i++){
+        sim.now += LCD_SIM_I2C_BYTE_US;
+        sim.counters.i2c_bytes++;
+        sim_expander_out(data[i]);
+    }
+
+}
+
+byte sim_i2c_read(byte address){
+
+    byte pins;
+
+    if (address != LCD_SIM_PCF8574_ADDRESS) return 0xFF;
+
+    sim.counters.i2c_transactions++;
+    sim.now += 2*LCD_SIM_I2C_BYTE_US;
+
+    // Outputs set high are weak pull-ups, the LCD pulls them down while it drives DB4..DB7
+    pins = sim.expander;
+    if (sim.rw && ctl->en)
+        pins &= (sim_get_data() << LCD_PCF8574_DATA_LSB) | ~LCD_PCF8574_DATA_MASK;
+
+    return pins;
+
+}
+
+void sim_expander_out(byte pins){
+
+    sim.expander = pins;
+
+    sim_set_rs(pins & LCD_PCF8574_RS);
+    sim_set_rw(pins & LCD_PCF8574_RW);
+    sim_set_data((pins & LCD_PCF8574_DATA_MASK) >> LCD_PCF8574_DATA_LSB);
+    sim_set_en(LCD_E_MASK, pins & LCD_PCF8574_E);
+
+}
+#endif
+
+
+/// CONTROLLER
+
+void sim_busy_for(unsigned int us){
+    ctl->busy_until = sim.now + (unsigned long)us * LCD_SIM_FOSC_KHZ / ctl->fosc_khz;
+}
+
+byte sim_ddram_index(lcd_sim_controller *c, byte address){
+
+    address &= 0x7F;
+
+    if (!c->two_lines)
+        return address < LCD_SIM_DDRAM_SIZE ? address : 0;
+
+    if (address >= 0x40) address = address - 0x40 + LCD_SIM_DDRAM_SIZE/2;
+    return address < LCD_SIM_DDRAM_SIZE ? address : 0;
+
+}
+
+void sim_move_ac(byte right){
+
+    byte index;
+
+    if (ctl->cgram_selected){
+        ctl->ac = (ctl->ac + (right ? 1 : LCD_SIM_CGRAM_SIZE - 1)) & (LCD_SIM_CGRAM_SIZE - 1);
+        return;
+    }
+
+    index = sim_ddram_index(ctl, ctl->ac);
+    index = (index + (right ? 1 : LCD_SIM_DDRAM_SIZE - 1)) % LCD_SIM_DDRAM_SIZE;
+
+    if (ctl->two_lines && index >= LCD_SIM_DDRAM_SIZE/2)
+        ctl->ac = index - LCD_SIM_DDRAM_SIZE/2 + 0x40;
+    else
+        ctl->ac = index;
+
+}
+
+void sim_shift_display(byte left){
+
+    byte width;
+
+    width = ctl->two_lines ? LCD_SIM_DDRAM_SIZE/2 : LCD_SIM_DDRAM_SIZE;
+    ctl->shift = (ctl->shift + (left ? 1 : width - 1)) % width;
+
+}
+
+void sim_write(byte rs, byte value){
+
+    if (sim.now < ctl->busy_until)
+        sim.counters.busy_violations++;
+    sim.counters.bytes_written++;
+
+    if (rs){
+
+        sim.counters.data_writes++;
+
+        if (ctl->cgram_selected)
+            ctl->cgram[ctl->ac & (LCD_SIM_CGRAM_SIZE - 1)] = value;
+        else
+            ctl->ddram[sim_ddram_index(ctl, ctl->ac)] = value;
+
+        sim_move_ac(ctl->entry & 0x02);
+        if ((ctl->entry & 0x01) && !ctl->cgram_selected)
+            sim_shift_display(ctl->entry & 0x02);
+
+        sim_busy_for(SIM_EXEC_US + SIM_ADD_US);
+        return;
+
+    }
+
+    sim.counters.instructions++;
+
+    if (value & 0x80){
+
+        ctl->ac = value & 0x7F;
+        ctl->cgram_selected = 0;
+
+    }else if (value & 0x40){
+
+        ctl->ac = value & 0x3F;
+        ctl->cgram_selected = 1;
+
+    }else if (value & 0x20){
+
+        // Function set. Init sequence's first ones take longer
+        if (!ctl->four_bit && (value & 0x10) && ctl->init_writes < 2){
+            ctl->init_writes++;
+            ctl->busy_until = sim.now + (ctl->init_writes == 1 ? SIM_INIT1_US : SIM_INIT2_US);
+            return;
+        }
+        ctl->four_bit = !(value & 0x10);
+        ctl->two_lines = value & 0x08 ? 1 : 0;
+
+    }else if (value & 0x10){
+
+        if (value & 0x08) sim_shift_display(!(value & 0x04));
+        else sim_move_ac(value & 0x04);
+
+    }else if (value & 0x08){
+
+        ctl->control = value & 0x07;
+
+    }else if (value & 0x04){
+
+        ctl->entry = value & 0x03;
+
+    }else if (value & 0x02){
+
+        ctl->ac = 0;
+        ctl->cgram_selected = 0;
+        ctl->shift = 0;
+        sim_busy_for(SIM_EXEC_HOME_US);
+        return;
+
+    }else if (value & 0x01){
+
+        memset(ctl->ddram, ' ', LCD_SIM_DDRAM_SIZE);
+        ctl->ac = 0;
+        ctl->cgram_selected = 0;
+        ctl->shift = 0;
+        ctl->entry |= 0x02;
+        sim_busy_for(SIM_EXEC_HOME_US);
+        return;
+
+    }
+
+    sim_busy_for(SIM_EXEC_US);
+
+}
+
+byte sim_read(byte rs){
+
+    byte value;
+
+    if (!rs)
+        return (sim.now < ctl->busy_until ? 0x80 : 0x00) | (ctl->ac & 0x7F);
+
+    if (ctl->cgram_selected)
+        value = ctl->cgram[ctl->ac & (LCD_SIM_CGRAM_SIZE - 1)];
+    else
+        value = ctl->ddram[sim_ddram_index(ctl, ctl->ac)];
+
+    sim_move_ac(ctl->entry & 0x02);
+    sim_busy_for(SIM_EXEC_US + SIM_ADD_US);
+
+    return value;
+
+}
@@ -0,0 +1,151 @@
+/*
+
+HD44780 microaddict library 1.0
+Copyright (C) 2017 Ismael García-Marlowe
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+
+*/
+
+/*
+ * Host-side HD44780 simulator. It plugs into lcd4bits through the lcd_bus
+ * interface and models the controller as seen from its pins: nibble assembly,
+ * DDRAM, CGRAM, address counter, display shift and the busy time of every
+ * instruction. Time only advances through the backend's delay function, so
+ * the elapsed time it reports is the bus time the driver would spend on target.
+ *
+ * Build the driver for the host with LCD_BUS_CUSTOM defined, e.g.
+ *
+ *     gcc -DLCD_BUS_CUSTOM app.c lcd4bits.c lcd_sim.c
+ *
+ * and call lcd_sim_reset() and lcd_set_bus(&lcd_sim_bus) before initialize_lcd().
+ * The simulated LCD is wired the way the driver is built: DB4..DB7 only, or
+ * all of DB0..DB7 when LCD_8BIT is defined.
+ *
+ * In 4 bit builds a PCF8574 backpack can be put in between, to test the I2C
+ * backend: pass lcd_sim_i2c to lcd_pcf8574_setup() with LCD_SIM_PCF8574_ADDRESS
+ * and select lcd_pcf8574_bus instead of lcd_sim_bus.
+ */
+
+#ifndef LCD_SIM_H_
+#define LCD_SIM_H_
+
+#include "lcd4bits.h"
+#ifndef LCD_8BIT
+#include "lcd_pcf8574.h"
+#endif
+
+/// DEFINITIONS
+
+#define LCD_SIM_FOSC_KHZ         270      // Datasheet's nominal oscillator frequency
+#define LCD_SIM_DDRAM_SIZE       80
+#define LCD_SIM_CGRAM_SIZE       64
+#define LCD_SIM_CONTROLLERS      8        // Controllers on the bus, one per bit of the E port
+#define LCD_SIM_PCF8574_ADDRESS  0x27
+#define LCD_SIM_I2C_BYTE_US      23       // 9 clocks at 400 kHz, rounded up
+
+
+/// TYPE DEFINITIONS
+
+typedef struct {
+    unsigned long enable_pulses;            // Rising edges of E
+    unsigned long bytes_written;            // Complete bytes latched, instructions and data
+    unsigned long instructions;
+    unsigned long data_writes;
+    unsigned long reads;                    // Complete bytes read, busy flag and data
+    unsigned long busy_violations;          // Bytes latched while the LCD was still busy
+    unsigned long delay_us;                 // Total time spent in delay_us()
+    unsigned long i2c_transactions;         // Through the simulated PCF8574, reads included
+    unsigned long i2c_bytes;                // Bytes written to the PCF8574
+} lcd_sim_counters;
+
+
+/// PROTOTYPES
+
+extern const lcd_bus lcd_sim_bus;
+#ifndef LCD_8BIT
+extern const lcd_i2c lcd_sim_i2c;
+#endif
+
+/******************************************************************************
+ * Summary:         Puts every simulated controller into its power-on state and
+ *                  clears clock and counters.
+ *
+ * Input:           unsigned int fosc_khz  :   Oscillator frequency. Execution
+ *                                             times scale with LCD_SIM_FOSC_KHZ/fosc_khz.
+ *****************************************************************************/
+void lcd_sim_reset(unsigned int fosc_khz);
+
+/******************************************************************************
+ * Summary:         Selects the controller, by the bit of its E line, that the
+ *                  queries below report on. The one on LCD_E_BIT is selected at reset.
+ *****************************************************************************/
+void lcd_sim_select(byte e_bit);
+
+/******************************************************************************
+ * Summary:         Returns the simulated time elapsed since lcd_sim_reset().
+ *****************************************************************************/
+unsigned long lcd_sim_elapsed_us(void);
+
+/******************************************************************************
+ * Summary:         Advances the simulated clock without going through the driver,
+ *                  e.g. to model time spent by the application between ticks.
+ *****************************************************************************/
+void lcd_sim_advance_us(unsigned long us);
+
+/******************************************************************************
+ * Summary:         Returns bus activity counted since lcd_sim_reset() or the
+ *                  last call to lcd_sim_clear_counters().
+ *****************************************************************************/
+lcd_sim_counters lcd_sim_get_counters(void);
+void lcd_sim_clear_counters(void);
+
+/******************************************************************************
+ * Summary:         Returns the byte held at "address" in DDRAM.
+ *****************************************************************************/
+byte lcd_sim_ddram(byte address);
+
+/******************************************************************************
+ * Summary:         Returns the byte held at "address" in CGRAM.
+ *****************************************************************************/
+byte lcd_sim_cgram(byte address);
+
+/******************************************************************************
+ * Summary:         Returns the char shown at column "col" of row "row" (0 to 3,
+ *                  rows 2 and 3 wired as on LCD_COLS x 4 panels), taking display
+ *                  shift into account.
+ *****************************************************************************/
+char lcd_sim_visible(byte row, byte col);
+
+/******************************************************************************
+ * Summary:         Returns the address counter, display shift, display control
+ *                  and entry mode bits of the simulated LCD.
+ *****************************************************************************/
+byte lcd_sim_address_counter(void);
+byte lcd_sim_display_shift(void);
+byte lcd_sim_display_control(void);
+byte lcd_sim_entry_mode(void);
+
+/******************************************************************************
+ * Summary:         Changes DDRAM, CGRAM, the display control and entry mode bits,
+ *                  or the display shift of the simulated LCD behind the driver's
+ *                  back, as electrical noise would.
+ *****************************************************************************/
+void lcd_sim_corrupt_ddram(byte address, byte value);
+void lcd_sim_corrupt_cgram(byte address, byte value);
+void lcd_sim_corrupt_modes(byte display_control, byte entry_mode);
+void lcd_sim_corrupt_shift(byte shift);
+
+#endif /* LCD_SIM_H_ */